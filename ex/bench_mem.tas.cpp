@@ -0,0 +1,48 @@
+// Micro-benchmark for memory in tsim : stores words to a region of memory and
+// then loads them back, either in order or, with RANDOM defined, in the order
+// given by a linear congruential generator. Run it with `make bench` ; tsim
+// uses sparse memory by default, so pages are allocated as they are written.
+#ifndef LOG2_WORDS
+#define LOG2_WORDS 22
+#endif
+
+#include "common.th"
+
+#if RANDOM
+// c = address of the next word, from the generator state in f
+#define next_address    f <- f * g + 1 ; c <- f >> 8 ; c <- c & d ; c <- c + e
+#else
+#define next_address    f <- f + 1 ; c <- f & d ; c <- c + e
+#endif
+
+_start:
+    prologue
+    c <- 1
+    b <- c << LOG2_WORDS        // b = number of words in the region
+    d <- b - 1                  // d = mask for an offset into the region
+    e <- b                      // e = base of the region, clear of the program
+    g <- [rel(multiplier)]      // g = multiplier for the generator
+
+    f <- a
+    h <- b                      // h = loop counter
+store:
+    next_address
+    h -> [c]
+    h <- h - 1
+    i <- h <> a
+    jnzrel(i,store)
+
+    f <- a
+    h <- b
+load:
+    next_address
+    i <- [c]
+    h <- h - 1
+    i <- h <> a
+    jnzrel(i,load)
+
+    illegal
+
+multiplier:
+    .word 1664525
+
@@ -0,0 +1,61 @@
+// Micro-benchmark for instruction dispatch in tsim : a loop running every
+// operation, in both instruction types and with each kind of dereference.
+// Run it through each engine with `make bench`.
+#ifndef LOG2_ITERATIONS
+#define LOG2_ITERATIONS 20
+#endif
+
+#include "common.th"
+
+_start:
+    prologue
+    c <- 1
+    b <- c << LOG2_ITERATIONS   // b = loop counter
+    e <- rel(scratch)           // e = address of scratch words
+    d <- 3
+
+loop:
+    c <- b + d + 7              // type0 operations
+    c <- c - d + 1
+    c <- c * d
+    c <- c << d
+    c <- c >> d
+    f <- c < d
+    f <- c == d
+    f <- c > d
+    f <- c <> d
+    c <- c & d + 2
+    c <- c &~ d
+    c <- c | d
+    c <- c ^ d
+    c <- c ^~ d
+
+    c <- b + 7 + d              // type1 operations
+    c <- c - 1 + d
+    c <- c * 3 + d
+    c <- c << 2
+    c <- c >> 1
+    f <- c < 9 + d
+    f <- c == 9
+    f <- c > 9
+    f <- c <> 9
+    c <- c & 0x7ff
+    c <- c &~ 5
+    c <- c | 12 + d
+    c <- c ^ 3
+    c <- c ^~ 3
+
+    c -> [e]                    // each kind of dereference
+    [e] <- c + 1
+    f <- [e + 1]
+    f -> [e - 1 + d]
+
+    b <- b - 1
+    g <- b <> a
+    jnzrel(g,loop)
+
+    illegal
+
+scratch:
+    .word 0, 0, 0, 0
+
@@ -0,0 +1,17 @@
+#!/bin/bash
+# Times each execution engine of tsim on each image named on the command line,
+# for example :
+#   scripts/bench.sh ex/sieve.texe ex/fib_iter.texe
+# Extra tsim options can be passed in the TSIM_FLAGS environment variable.
+here=`dirname $0`
+tsim=$here/../tsim
+engines=("" "-rblocks" "-rjit")
+names=("interpreter" "blocks" "jit")
+TIMEFORMAT=%3R
+
+for image in "$@" ; do
+    for i in ${!engines[@]} ; do
+        elapsed=`{ time $tsim $TSIM_FLAGS ${engines[$i]} $image > /dev/null 2>&1 ; } 2>&1`
+        printf "%-30s %-12s %8ss\n" `basename $image` ${names[$i]} $elapsed
+    done
+done
@@ -0,0 +1,61 @@
+#!/bin/bash
+# Runs each image named on the command line under each execution engine of
+# tsim, comparing its output with the file named like the image but ending in
+# .out instead of .texe, for example :
+#   scripts/check.sh test/selfmod.texe
+# Other files named like the image change how it is run :
+#   .flags  options it needs (such as recipes for devices)
+#   .in     its input (otherwise it has none)
+#   .save   an instruction count after which to save a snapshot, from which
+#           the run is finished as well and must give the same output
+#   .dbg    debugger commands, run instead under the debugger, whose whole
+#           transcript is compared
+# More options can be passed in the TSIM_FLAGS environment variable. Exits
+# nonzero if any output differs.
+here=`dirname $0`
+tsim=$here/../tsim
+engines=("" "-rblocks" "-rjit -pjit.threshold=0")
+names=("interpreter" "blocks" "jit")
+status=0
+
+# compares the output of the tsim command in the remaining arguments
+check ()
+{
+    local name=$1 input=$2
+    shift 2
+    # a program that never ends must not hang the check
+    output=`timeout 10 $tsim "$@" < $input 2> /dev/null`
+    if [ "$output" = "`cat $stem.out`" ] ; then
+        result=ok
+    else
+        result=FAILED
+        status=1
+    fi
+    printf "%-30s %-12s %s\n" `basename $image` "$name" $result
+}
+
+for image in "$@" ; do
+    stem=${image%.texe}
+    flags=
+    [ -e $stem.flags ] && flags=`cat $stem.flags`
+    input=/dev/null
+    [ -e $stem.in ] && input=$stem.in
+    if [ -e $stem.dbg ] ; then
+        check debugger $stem.dbg $TSIM_FLAGS $flags -d $image
+        continue
+    fi
+    for i in ${!engines[@]} ; do
+        check ${names[$i]} $input $TSIM_FLAGS $flags ${engines[$i]} $image
+        if [ -e $stem.save ] ; then
+            snapshot=`mktemp`
+            timeout 10 $tsim $TSIM_FLAGS $flags ${engines[$i]} \
+                -psave.at=`cat $stem.save` --save=$snapshot $image \
+                < $input > /dev/null 2>&1
+            check "${names[$i]} restored" $input $TSIM_FLAGS $flags \
+                ${engines[$i]} --restore=$snapshot
+            rm -f $snapshot
+        fi
+    done
+done
+
+exit $status
@@ -0,0 +1,90 @@
+#!/usr/bin/perl
+# Plays a session with the GDB server of tsim for each image named on the
+# command line, for example :
+#   scripts/gdbcheck.pl test/reverse.texe
+# Each line of the file named like the image but ending in .gdb instead of
+# .texe holds a packet to send and the reply expected, separated by whitespace
+# (a reply of - means none is expected, as after k). Options an image needs are
+# read from a file ending in .flags if there is one, and more can be passed in
+# the TSIM_FLAGS environment variable. Exits nonzero if any reply differs.
+use strict;
+use warnings;
+
+use File::Basename;
+use File::Temp qw(tempdir);
+use IO::Socket::UNIX;
+use Time::HiRes qw(sleep);
+
+my $tsim = dirname($0) . "/../tsim";
+my $status = 0;
+
+sub send_packet
+{
+    my ($sock, $data) = @_;
+    my $sum = 0;
+    $sum += ord for split //, $data;
+    syswrite $sock, sprintf('$%s#%02x', $data, $sum % 256);
+}
+
+# returns the data of the next packet, acknowledging it, or undef at the end
+sub recv_packet
+{
+    my ($sock) = @_;
+    my ($c, $data) = ('', '');
+    do { sysread($sock, $c, 1) or return undef } until $c eq '$';
+    $data .= $c while sysread($sock, $c, 1) and $c ne '#';
+    sysread($sock, $c, 1) for 1 .. 2;   # the checksum, taken on trust
+    syswrite $sock, '+';
+    return $data;
+}
+
+for my $image (@ARGV) {
+    (my $stem = $image) =~ s/\.texe$//;
+    my $flags = -e "$stem.flags" ? `cat $stem.flags` : '';
+    chomp $flags;
+    my $where = tempdir(CLEANUP => 1) . "/gdb";
+
+    my $pid = fork;
+    if (!$pid) {
+        open STDIN , '<', '/dev/null';
+        open STDOUT, '>', '/dev/null';
+        open STDERR, '>', '/dev/null';
+        exec join ' ', $tsim, $ENV{TSIM_FLAGS} // '', $flags, "-g $where", $image;
+    }
+
+    my $sock;
+    for (1 .. 100) {
+        last if $sock = IO::Socket::UNIX->new(Peer => $where);
+        sleep 0.05;
+    }
+
+    my $result = $sock ? 'ok' : 'FAILED (no server)';
+    open my $session, '<', "$stem.gdb" or die "Cannot open $stem.gdb: $!";
+    while ($sock and my $line = <$session>) {
+        my ($packet, $expected) = split ' ', $line;
+        next unless defined $packet;
+        send_packet($sock, $packet);
+        next if $expected eq '-';
+        # a program that never stops must not hang the check
+        my $reply = eval {
+            local $SIG{ALRM} = sub { die "timeout\n" };
+            alarm 10;
+            my $got = recv_packet($sock);
+            alarm 0;
+            $got;
+        } // '(nothing)';
+        if ($reply ne $expected) {
+            $result = "FAILED ($packet gave $reply)";
+            last;
+        }
+    }
+
+    close $sock if $sock;
+    kill 'TERM', $pid;
+    waitpid $pid, 0;
+
+    printf "%-30s %-12s %s\n", basename($image), 'gdb', $result;
+    $status = 1 if $result ne 'ok';
+}
+
+exit $status;
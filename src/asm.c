@@ -232,6 +232,7 @@ struct obj_fdata {
     long rlcs;
 
     struct objrec *curr_rec;
+    struct objsym *curr_sym;    ///< next symbol to be read
 
     struct objsym **next_sym;
     struct objrlc **next_rlc;
@@ -261,6 +262,7 @@ static int obj_init(FILE *stream, int flags, void **ud)
     } else if (flags & ASM_DISASSEMBLE) {
         rc = obj_read(u->o, stream);
         u->curr_rec = o->records;
+        u->curr_sym = o->symbols;
     }
 
     return rc;
@@ -298,6 +300,26 @@ static int obj_in(FILE *stream, struct instruction *i, void *ud)
     return rc;
 }
 
+static long obj_block(FILE *stream, const uint32_t **data, void *ud)
+{
+    struct obj_fdata *u = ud;
+
+    struct objrec *rec = u->curr_rec;
+    while (rec && u->pos >= rec->size) {
+        u->curr_rec = rec = rec->next;
+        u->pos = 0;
+    }
+
+    if (!rec)
+        return 0;
+
+    long count = rec->size - u->pos;
+    *data = &rec->data[u->pos];
+    u->pos = rec->size;
+
+    return count;
+}
+
 static void obj_out_insn(struct instruction *i, struct obj_fdata *u, struct obj *o)
 {
     o->records->data[u->insns] = i->u.word;
@@ -319,7 +341,18 @@ static int obj_sym(FILE *stream, struct symbol *symbol, void *ud)
     int rc = 1;
     struct obj_fdata *u = ud;
 
-    if (symbol->global) {
+    if (u->flags & ASM_DISASSEMBLE) {
+        struct objsym *sym = u->curr_sym;
+        if (!sym)
+            return 0;
+
+        strcopy(symbol->name, sym->name, sizeof symbol->name);
+        symbol->reladdr = sym->value;
+        symbol->resolved = 1;
+        symbol->global = 1;
+
+        u->curr_sym = sym->next;
+    } else if (symbol->global) {
         struct objsym *sym = *u->next_sym = calloc(1, sizeof *sym);
 
         strcopy(sym->name, symbol->name, sizeof sym->name);
@@ -447,7 +480,8 @@ const struct format formats[] = {
         .out   = obj_out,
         .fini  = obj_fini,
         .sym   = obj_sym,
-        .reloc = obj_reloc },
+        .reloc = obj_reloc,
+        .block = obj_block },
     { "raw" , .in = raw_in , .out = raw_out  },
     { "text", .in = text_in, .out = text_out },
     { "verilog", .init = verilog_init, .out = verilog_out, .fini = verilog_fini },
@@ -1,6 +1,7 @@
 #ifndef ASM_H_
 #define ASM_H_
 
+#include <stdint.h>
 #include <stdio.h>
 
 enum { ASM_ASSEMBLE = 1, ASM_DISASSEMBLE = 2 };
@@ -15,7 +16,12 @@ struct format {
     int (*in   )(FILE *, struct instruction *, void *ud);
     int (*out  )(FILE *, struct instruction *, void *ud);
 
+    /// when disassembling, fills in the next symbol, returning 0 after the last
     int (*sym  )(FILE *, struct symbol *, void *ud);
+    /// when disassembling, may be used in place of in() : points *data at the
+    /// next run of consecutive words and returns their count, or 0 after the
+    /// last ; the words remain valid until fini()
+    long (*block)(FILE *, const uint32_t **data, void *ud);
     int (*reloc)(FILE *, struct reloc_node *, void *ud);
     int (*fini )(FILE *, void **ud);
 };
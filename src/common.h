@@ -10,6 +10,7 @@
 #define STR(X) STR_(X)
 #define STR_(X) #X
 #define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
+#define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
 #define SEXTEND(Bits,X) (struct { signed i:(Bits); }){ .i = (X) }.i
 
 #define UNUSED   __attribute__((unused))
@@ -3,11 +3,63 @@
 
 #include "common.h"
 
+struct sim_state;
+struct machine_state;
+
 struct debug_expr {
     enum expr_type { EXPR_NULL, EXPR_MEM, EXPR_REG } type;
     int32_t val;
 };
 
+enum watch_type {
+    WATCH_READ   = 1,
+    WATCH_WRITE  = 2,
+    WATCH_ACCESS = WATCH_READ | WATCH_WRITE,
+};
+
+// A breakpoint condition is compiled to operations on a stack. Each binary
+// operation pops b, then a, and pushes the value given here.
+#define COND_BINOPS(_) \
+    _(LOR   , a || b) \
+    _(LAND  , a && b) \
+    _(OR    , a |  b) \
+    _(XOR   , a ^  b) \
+    _(AND   , a &  b) \
+    _(EQ    , a == b) \
+    _(NE    , a != b) \
+    _(LT    , a <  b) \
+    _(LE    , a <= b) \
+    _(GT    , a >  b) \
+    _(GE    , a >= b) \
+    _(ADD   , (int32_t)((uint32_t)a + (uint32_t)b)) \
+    _(SUBTRACT, (int32_t)((uint32_t)a - (uint32_t)b)) \
+    //
+
+enum cond_code {
+    COND_CONST,     ///< pushes val
+    COND_REG,       ///< pushes register val
+    COND_MEM,       ///< replaces an address with the word there
+    COND_NEG,
+    COND_NOT,
+    COND_INV,
+
+    #define COND_ENUM(Name,Expr) COND_##Name,
+    COND_BINOPS(COND_ENUM)
+    #undef COND_ENUM
+
+    COND_max
+};
+
+#define COND_LEN 64
+
+struct debug_cond {
+    int len;    ///< operations in ops, or -1 if there were too many
+    struct cond_op {
+        int code;
+        int32_t val;
+    } ops[COND_LEN];
+};
+
 enum display_type {
     DISP_NULL,
 
@@ -22,7 +74,9 @@ struct debugger_data {
     struct sim_state *s;    ///< simulator state to which we belong
 
     void *scanner;
+    int quiet;  ///< whether to keep changes to breakpoints to ourselves
     void *breakpoints;
+    unsigned char *bp_map;  ///< one bit per address, set for enabled breakpoints
 
     struct {
         unsigned savecol;
@@ -37,16 +91,40 @@ struct debugger_data {
     } *displays;
     int displays_count;
 
+    struct watchpoint {
+        struct watchpoint *next;
+
+        uint32_t addr, len;     ///< the words watched are [addr, addr + len)
+        int type;               ///< which accesses stop the program
+    } *watchpoints;
+    /// the access that last matched a watchpoint, if any, since it was cleared
+    struct watch_hit {
+        struct watchpoint *wp;
+        int op;
+        uint32_t addr, data;
+    } hit;
+
+    struct debug_cond cond; ///< condition compiled by the last command
+
+    void *checkpoint;   ///< FILE holding the snapshot taken by `checkpoint'
+
     struct debug_cmd {
         enum {
             CMD_NULL,
 
+            CMD_CHECKPOINT,
             CMD_CONTINUE,
             CMD_DELETE_BREAKPOINT,
+            CMD_DELETE_WATCHPOINT,
             CMD_DISPLAY,
             CMD_GET_INFO,
+            CMD_LAST_WRITE,
             CMD_PRINT,
+            CMD_REVERSE_CONTINUE,
+            CMD_REVERSE_STEP,
+            CMD_REWIND,
             CMD_SET_BREAKPOINT,
+            CMD_SET_WATCHPOINT,
             CMD_STEP_INSTRUCTION,
             CMD_QUIT,
 
@@ -55,6 +133,10 @@ struct debugger_data {
         struct {
             struct debug_expr expr;
             int fmt;   ///< print / display format character
+            int watch; ///< watchpoint type
+            int32_t len;    ///< words covered by a watchpoint
+            int cond;       ///< whether the breakpoint takes the condition
+            uint32_t after; ///< hits of the breakpoint before it stops us
             char str[LINE_LEN];
         } arg;
     } cmd;
@@ -63,5 +145,29 @@ struct debugger_data {
 int tdbg_parse(struct debugger_data *);
 int tdbg_prompt(struct debugger_data *dd, FILE *where);
 
+// Operations shared by the command line and the GDB server (gdbserver.c),
+// which are found in tsim.c. Addresses are word addresses.
+int tdbg_init(struct debugger_data *dd, struct sim_state *s);
+int tdbg_fini(struct debugger_data *dd);
+int tdbg_set_breakpoint(struct debugger_data *dd, int32_t addr, int cond,
+        uint32_t after);
+/// returns nonzero if there was no breakpoint at addr
+int tdbg_delete_breakpoint(struct debugger_data *dd, int32_t addr);
+int tdbg_set_watchpoint(struct debugger_data *dd, int32_t addr, int32_t len,
+        int type);
+/// removes a watchpoint at addr of the given type, or of any type if type is
+/// 0 ; returns nonzero if there was none
+int tdbg_delete_watchpoint(struct debugger_data *dd, int32_t addr, int type);
+/// a predicate for tf_run_until(), taking dd, which stops at breakpoints and
+/// after an access that a watchpoint covers (see dd->hit)
+int tdbg_stops(struct machine_state *m, void *dd);
+/// undoes instructions back to a breakpoint or a watched write, returning as
+/// undo_step() does if it could go no further
+int tdbg_reverse_continue(struct debugger_data *dd);
+
+/// serves the GDB remote protocol on where, a TCP port number or a Unix
+/// domain socket path, until the client detaches or kills the target
+int gdb_serve(struct sim_state *s, const char *where);
+
 #endif
 
@@ -11,6 +11,7 @@
 #include "debugger_lexer.h"
 
 int tdbg_error(YYLTYPE *locp, struct debugger_data *dd, const char *s);
+static void cond_emit(struct debugger_data *dd, int code, int32_t val);
 
 #define YYLEX_PARAM (dd->scanner)
 
@@ -27,11 +28,26 @@ int tdbg_error(YYLTYPE *locp, struct debugger_data *dd, const char *s);
 %start top
 
 %type <expr> expr addr_expr
-%type <i32> integer regname
-%type <cmd> command display_command info_command print_command
+%type <i32> integer regname watch
+%type <cmd> command display_command info_command print_command watch_command
+%type <cmd> break_command
 %type <chr> format
 
-%token STEPI DISPLAY INFO PRINT
+%token STEPI DISPLAY INFO PRINT CHECKPOINT REWIND
+%token WATCH RWATCH AWATCH UNWATCH RSTEPI RCONTINUE LAST
+%token IF AFTER
+%token EQ NE LE GE LAND LOR
+%token '(' ')' '+' '-' '&' '|' '^' '!' '~' '<' '>'
+
+%left LOR
+%left LAND
+%left '|'
+%left '^'
+%left '&'
+%left EQ NE
+%left '<' '>' LE GE
+%left '+' '-'
+%right UNARY
 %token <str> INTEGER IDENT
 %token UNKNOWN
 %token NL WHITESPACE
@@ -56,6 +72,7 @@ top
 maybe_command
     : NL { YYACCEPT; }
     | maybe_whitespace command maybe_whitespace NL { dd->cmd = $command; YYACCEPT; }
+    | maybe_whitespace break_command NL { dd->cmd = $break_command; YYACCEPT; }
     | error NL
         {   yyerrok;
             fputs("Invalid command\n", stderr);
@@ -63,10 +80,7 @@ maybe_command
             YYABORT; }
 
 command
-    : 'b' whitespace addr_expr
-        {   $command.code = CMD_SET_BREAKPOINT;
-            $command.arg.expr = $addr_expr; }
-    | 'd' whitespace addr_expr
+    : 'd' whitespace addr_expr
         {   $command.code = CMD_DELETE_BREAKPOINT;
             $command.arg.expr = $addr_expr; }
     | 'c'
@@ -75,9 +89,86 @@ command
         {   $command.code = CMD_STEP_INSTRUCTION; }
     | 'q'
         {   $command.code = CMD_QUIT; }
+    | CHECKPOINT
+        {   $command.code = CMD_CHECKPOINT; }
+    | REWIND
+        {   $command.code = CMD_REWIND; }
+    | RSTEPI
+        {   $command.code = CMD_REVERSE_STEP; }
+    | RCONTINUE
+        {   $command.code = CMD_REVERSE_CONTINUE; }
+    | LAST whitespace addr_expr
+        {   $command.code = CMD_LAST_WRITE;
+            $command.arg.expr = $addr_expr; }
     | print_command
     | display_command
     | info_command
+    | watch_command
+
+/* A breakpoint takes up its own trailing whitespace, which is otherwise
+ * indistinguishable from the whitespace before `if' or `after'. Whitespace
+ * within a condition is dropped by the lexer. */
+break_command
+    : 'b' whitespace addr_expr maybe_whitespace
+        {   $break_command.code = CMD_SET_BREAKPOINT;
+            $break_command.arg.expr = $addr_expr;
+            $break_command.arg.cond = 0;
+            $break_command.arg.after = 0; }
+    | 'b' whitespace addr_expr whitespace IF
+        {   dd->cond.len = 0; }
+      cond
+        {   $break_command.code = CMD_SET_BREAKPOINT;
+            $break_command.arg.expr = $addr_expr;
+            $break_command.arg.cond = 1;
+            $break_command.arg.after = 0; }
+    | 'b' whitespace addr_expr whitespace AFTER whitespace integer maybe_whitespace
+        {   $break_command.code = CMD_SET_BREAKPOINT;
+            $break_command.arg.expr = $addr_expr;
+            $break_command.arg.cond = 0;
+            $break_command.arg.after = $integer; }
+
+/* Operations are emitted as they are reduced, which is in postfix order. */
+cond
+    : integer           { cond_emit(dd, COND_CONST, $integer); }
+    | regname           { cond_emit(dd, COND_REG, $regname); }
+    | '(' cond ')'
+    | '*' cond %prec UNARY  { cond_emit(dd, COND_MEM, 0); }
+    | '-' cond %prec UNARY  { cond_emit(dd, COND_NEG, 0); }
+    | '!' cond %prec UNARY  { cond_emit(dd, COND_NOT, 0); }
+    | '~' cond %prec UNARY  { cond_emit(dd, COND_INV, 0); }
+    | cond LOR cond     { cond_emit(dd, COND_LOR, 0); }
+    | cond LAND cond    { cond_emit(dd, COND_LAND, 0); }
+    | cond '|' cond     { cond_emit(dd, COND_OR, 0); }
+    | cond '^' cond     { cond_emit(dd, COND_XOR, 0); }
+    | cond '&' cond     { cond_emit(dd, COND_AND, 0); }
+    | cond EQ cond      { cond_emit(dd, COND_EQ, 0); }
+    | cond NE cond      { cond_emit(dd, COND_NE, 0); }
+    | cond '<' cond     { cond_emit(dd, COND_LT, 0); }
+    | cond LE cond      { cond_emit(dd, COND_LE, 0); }
+    | cond '>' cond     { cond_emit(dd, COND_GT, 0); }
+    | cond GE cond      { cond_emit(dd, COND_GE, 0); }
+    | cond '+' cond     { cond_emit(dd, COND_ADD, 0); }
+    | cond '-' cond     { cond_emit(dd, COND_SUBTRACT, 0); }
+
+watch_command
+    : watch whitespace addr_expr
+        {   $watch_command.code = CMD_SET_WATCHPOINT;
+            $watch_command.arg.watch = $watch;
+            $watch_command.arg.len = 1;
+            $watch_command.arg.expr = $addr_expr; }
+    | watch '/' integer whitespace addr_expr
+        {   $watch_command.code = CMD_SET_WATCHPOINT;
+            $watch_command.arg.watch = $watch;
+            $watch_command.arg.len = $integer;
+            $watch_command.arg.expr = $addr_expr; }
+    | UNWATCH whitespace addr_expr
+        {   $watch_command.code = CMD_DELETE_WATCHPOINT;
+            $watch_command.arg.expr = $addr_expr; }
+
+watch
+    : WATCH  { $watch = WATCH_WRITE; }
+    | RWATCH { $watch = WATCH_READ; }
+    | AWATCH { $watch = WATCH_ACCESS; }
 
 display_command
     : DISPLAY whitespace expr
@@ -153,6 +244,15 @@ int tdbg_prompt(struct debugger_data *dd, FILE *where)
     return 0;
 }
 
+static void cond_emit(struct debugger_data *dd, int code, int32_t val)
+{
+    struct debug_cond *c = &dd->cond;
+    if (c->len < 0 || c->len >= COND_LEN)
+        c->len = -1;
+    else
+        c->ops[c->len++] = (struct cond_op){ code, val };
+}
+
 int tdbg_error(YYLTYPE *locp, struct debugger_data *dd, const char *s)
 {
     fflush(stderr);
@@ -2,23 +2,90 @@
 #define DEVICES_H_
 
 #include <stdint.h>
+#include <stdio.h>
 
 #include "common.h"
 #include "sim.h"
+#include "snapshot.h"
 
+/// the device itself follows cookie, so that it can find its bounds and look up
+/// parameters with device_param_get()
 typedef int map_init(struct sim_state *s, void *cookie, ...);
 typedef int map_op(struct sim_state *s, void *cookie, int op, uint32_t addr, uint32_t *data);
-typedef int map_cycle(struct sim_state *s, void *cookie);
+/// called once machine.cycles reaches the deadline given by the previous call
+/// (the first call comes after the first instruction) ; now is the current
+/// value of machine.cycles, and *next must be set to the next deadline, or to
+/// UINT64_MAX if there is none until the device is next written ; what a device
+/// with a cycle hook reads back may change only in cycle() or on a write, so
+/// that a loop that only polls it may be skipped to its deadline
+typedef int map_cycle(struct sim_state *s, void *cookie, uint64_t now, uint64_t *next);
 typedef int map_fini(struct sim_state *s, void *cookie);
+/// returns host storage for the DISPATCH_PAGE_WORDS words of the dispatch page
+/// containing addr, or NULL if there is none (yet)
+typedef uint32_t *map_page(struct sim_state *s, void *cookie, uint32_t addr);
+/// like map_page, but returns storage that may only be read, for a page that
+/// map_page has none for
+typedef const uint32_t *map_page_shared(struct sim_state *s, void *cookie, uint32_t addr);
+/// copies count words starting at addr out of the device into buf ; the words
+/// must all lie within the device's bounds
+typedef int map_read_block(struct sim_state *s, void *cookie, uint32_t addr,
+        uint32_t count, uint32_t *buf);
+/// like map_read_block, but copies the words from buf into the device
+typedef int map_write_block(struct sim_state *s, void *cookie, uint32_t addr,
+        uint32_t count, const uint32_t *buf);
+/// writes the state of the device for a snapshot (see snapshot.h)
+typedef int map_serialize(struct sim_state *s, void *cookie, FILE *out);
+/// reads back exactly what map_serialize wrote ; returns nonzero on failure
+typedef int map_deserialize(struct sim_state *s, void *cookie, FILE *in);
+
+#define DEVICE_NAME_LEN 32
 
 struct device {
     uint32_t bounds[2]; // lower and upper memory bounds, inclusive
+    char name[DEVICE_NAME_LEN]; // instance name, which prefixes its parameters
     map_init *init;
     map_op *op;
     map_cycle *cycle;
     map_fini *fini;
+    map_page *page; // optional ; only for devices that behave as plain memory
+    map_page_shared *page_shared;   // optional ; only with page
+    map_read_block *read_block;     // optional ; otherwise op() is used per word
+    map_write_block *write_block;   // optional ; otherwise op() is used per word
+    map_serialize *serialize;       // optional ; only for devices with state
+    map_deserialize *deserialize;   // required if serialize is present
     void *cookie;
+    int op_flags; // flags (OP_DATA) that op() is passed along with the op
+    uint64_t deadline; // when cycle() is next due, in machine.cycles
+    uint64_t accesses; // loads and stores made by instructions
 };
 
+// looks up parameter key of device d, as "<name>.<key>"
+static inline int device_param_get(struct sim_state *s, const struct device *d,
+        const char *key, const char **val)
+{
+    char buf[DEVICE_NAME_LEN + 64];
+    snprintf(buf, sizeof buf, "%s.%s", d->name, key);
+    return param_get(s, buf, val);
+}
+
+// raises interrupt line
+static inline void device_irq(struct sim_state *s, unsigned line)
+{
+    s->machine.irq.pending |= 1u << line;
+    irq_update(&s->machine.irq);
+}
+
+// looks up the storage for a dispatch page that lies wholly within d
+static inline void device_map_page(struct sim_state *s, struct device *d,
+        uint32_t page)
+{
+    uint32_t addr = page << DISPATCH_PAGE_BITS;
+    uint32_t *mem = d && d->page ? d->page(s, d->cookie, addr) : NULL;
+    s->machine.page_mem[page] = mem;
+    s->machine.page_read[page] = mem;
+    if (!mem && d && d->page_shared)
+        s->machine.page_read[page] = d->page_shared(s, d->cookie, addr);
+}
+
 #endif
 
@@ -0,0 +1,94 @@
+// Maps the simulator's performance counters into memory, so that a program
+// can time itself. Each count is a read-only pair of words, low word first :
+// instructions retired, and then each of COUNTERS in order. Reading a low word
+// latches the high word of the same count, so that a 64-bit count can be read
+// consistently.
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "device.h"
+
+#define COUNTERS_BASE   (1ULL << 8)
+#define COUNTERS_ONE(Name,Desc) + 1
+#define COUNTERS_COUNT  (1 COUNTERS(COUNTERS_ONE))
+#define COUNTERS_END    (COUNTERS_BASE + COUNTERS_COUNT * 2 - 1)
+
+struct counters_state {
+    uint32_t latched;   ///< high word of the count whose low word was last read
+};
+
+static int counters_init(struct sim_state *s, void *cookie, ...)
+{
+    struct counters_state *counters = *(void**)cookie = malloc(sizeof *counters);
+    counters->latched = 0;
+
+    return 0;
+}
+
+static int counters_fini(struct sim_state *s, void *cookie)
+{
+    free(cookie);
+
+    return 0;
+}
+
+static int counters_op(struct sim_state *s, void *cookie, int op, uint32_t addr,
+        uint32_t *data)
+{
+    struct counters_state *counters = cookie;
+    assert(("Address within address space", !(addr & ~PTR_MASK)));
+
+    const uint64_t values[COUNTERS_COUNT] = {
+        s->machine.cycles,
+#define COUNTERS_VALUE(Name,Desc) s->machine.counters.Name,
+        COUNTERS(COUNTERS_VALUE)
+    };
+
+    uint32_t offset = addr - COUNTERS_BASE;
+    if (op == OP_READ) {
+        if (offset & 1) {
+            *data = counters->latched;
+        } else {
+            uint64_t value = values[offset / 2];
+            *data = value;
+            counters->latched = value >> 32;
+        }
+    } else if (op != OP_WRITE) {
+        return 1;
+    }
+
+    // writes are ignored
+    return 0;
+}
+
+static int counters_serialize(struct sim_state *s, void *cookie, FILE *out)
+{
+    struct counters_state *counters = cookie;
+    SNAPSHOT_PUT(counters->latched, out);
+    return 0;
+}
+
+static int counters_deserialize(struct sim_state *s, void *cookie, FILE *in)
+{
+    struct counters_state *counters = cookie;
+    SNAPSHOT_GET(counters->latched, in);
+    return 0;
+}
+
+int counters_add_device(struct device **device)
+{
+    **device = (struct device){
+        .bounds = { COUNTERS_BASE, COUNTERS_END },
+        .op = counters_op,
+        .init = counters_init,
+        .fini = counters_fini,
+        .serialize = counters_serialize,
+        .deserialize = counters_deserialize,
+    };
+
+    return 0;
+}
+
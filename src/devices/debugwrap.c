@@ -15,8 +15,7 @@ static int debugwrap_init(struct sim_state *s, void *cookie, ...)
 {
     // our own init done in debugwrap_add_device ()
     struct debugwrap_state *debugwrap = *(void**)cookie;
-    // TODO varargs ?
-    debugwrap->wrapped->init(s, &debugwrap->wrapped->cookie);
+    debugwrap->wrapped->init(s, &debugwrap->wrapped->cookie, debugwrap->wrapped);
     return 0;
 }
 
@@ -42,6 +41,65 @@ static int debugwrap_op(struct sim_state *s, void *cookie, int op, uint32_t addr
     return 0;
 }
 
+static int debugwrap_read_block(struct sim_state *s, void *cookie, uint32_t addr,
+        uint32_t count, uint32_t *buf)
+{
+    struct debugwrap_state *debugwrap = cookie;
+    struct device *wrapped = debugwrap->wrapped;
+
+    int rc = 0;
+    if (wrapped->read_block)
+        rc = wrapped->read_block(s, wrapped->cookie, addr, count, buf);
+    else
+        for (uint32_t i = 0; i < count && !rc; i++)
+            rc = wrapped->op(s, wrapped->cookie, OP_READ, addr + i, &buf[i]);
+
+    for (uint32_t i = 0; i < count; i++)
+        printf("%-5s @ 0x%06x = %#x\n", "read", addr + i, buf[i]);
+
+    return rc;
+}
+
+static int debugwrap_write_block(struct sim_state *s, void *cookie, uint32_t addr,
+        uint32_t count, const uint32_t *buf)
+{
+    struct debugwrap_state *debugwrap = cookie;
+    struct device *wrapped = debugwrap->wrapped;
+
+    int rc = 0;
+    if (wrapped->write_block) {
+        rc = wrapped->write_block(s, wrapped->cookie, addr, count, buf);
+    } else {
+        for (uint32_t i = 0; i < count && !rc; i++) {
+            uint32_t word = buf[i];
+            rc = wrapped->op(s, wrapped->cookie, OP_WRITE, addr + i, &word);
+        }
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+        printf("%-5s @ 0x%06x = %#x\n", "write", addr + i, buf[i]);
+
+    return rc;
+}
+
+static int debugwrap_serialize(struct sim_state *s, void *cookie, FILE *out)
+{
+    struct debugwrap_state *debugwrap = cookie;
+    if (debugwrap->wrapped->serialize)
+        return debugwrap->wrapped->serialize(s, debugwrap->wrapped->cookie, out);
+
+    return 0;
+}
+
+static int debugwrap_deserialize(struct sim_state *s, void *cookie, FILE *in)
+{
+    struct debugwrap_state *debugwrap = cookie;
+    if (debugwrap->wrapped->deserialize)
+        return debugwrap->wrapped->deserialize(s, debugwrap->wrapped->cookie, in);
+
+    return 1;
+}
+
 int debugwrap_add_device(struct device **device, struct device *wrap)
 {
     struct debugwrap_state *debugwrap = malloc(sizeof *debugwrap);
@@ -50,10 +108,15 @@ int debugwrap_add_device(struct device **device, struct device *wrap)
     **device = (struct device){
         .bounds = { wrap->bounds[0], wrap->bounds[1] },
         .op = debugwrap_op,
+        .read_block = debugwrap_read_block,
+        .write_block = debugwrap_write_block,
         .init = debugwrap_init,
         .fini = debugwrap_fini,
+        .serialize = debugwrap_serialize,
+        .deserialize = debugwrap_deserialize,
         .cookie = debugwrap,
     };
+    memcpy((*device)->name, wrap->name, sizeof wrap->name);
 
     return 0;
 }
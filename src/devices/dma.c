@@ -0,0 +1,203 @@
+// A DMA controller, which moves blocks of words between any two places in the
+// address space (RAM or devices) while the program runs. Registers :
+//   DMA_BASE + 0 : source address, or the value to store if DMA_FILL is set
+//   DMA_BASE + 1 : destination address
+//   DMA_BASE + 2 : length in words
+//   DMA_BASE + 3 : control ; writing DMA_GO (with DMA_FILL, to fill rather
+//                  than copy) starts a transfer, and reading gives DMA_BUSY
+//                  until it ends, with DMA_ERROR if an access failed
+// Registers are not written while a transfer is in progress. A transfer moves
+// dma.rate words per cycle (DMA_RATE by default). If the source and the
+// destination overlap, the result is unspecified. Another instance named, for
+// example, dma1 takes dma1.rate instead.
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "device.h"
+
+#define DMA_BASE    0x300
+#define DMA_END     (DMA_BASE + 3)
+#define DMA_RATE    4
+/// most words moved at once, and so between calls to dma_cycle()
+#define DMA_CHUNK   1024
+
+enum { DMA_SRC, DMA_DST, DMA_LEN, DMA_CTRL, DMA_REGS };
+enum { DMA_GO = 1, DMA_BUSY = 1, DMA_FILL = 2, DMA_ERROR = 4 };
+
+struct dma_state {
+    uint32_t base;      ///< address of the first register
+    uint32_t regs[DMA_REGS];
+    uint32_t done;      ///< words moved so far in the current transfer
+    uint64_t last;      ///< machine cycle up to which words have been moved
+    uint32_t rate;      ///< words moved per cycle
+};
+
+static int dma_init(struct sim_state *s, void *cookie, ...)
+{
+    va_list ap;
+    va_start(ap, cookie);
+    struct device *device = va_arg(ap, struct device *);
+    va_end(ap);
+
+    struct dma_state *dma = *(void**)cookie = calloc(1, sizeof *dma);
+    dma->base = device->bounds[0];
+
+    const char *val;
+    dma->rate = DMA_RATE;
+    if (device_param_get(s, device, "rate", &val))
+        dma->rate = strtoul(val, NULL, 0);
+    if (dma->rate == 0)
+        fatal(0, "Parameter %s.rate must be positive", device->name);
+
+    return 0;
+}
+
+static int dma_fini(struct sim_state *s, void *cookie)
+{
+    free(cookie);
+
+    return 0;
+}
+
+static int dma_op(struct sim_state *s, void *cookie, int op, uint32_t addr,
+        uint32_t *data)
+{
+    struct dma_state *dma = cookie;
+    assert(("Address within address space", !(addr & ~PTR_MASK)));
+
+    uint32_t offset = addr - dma->base;
+    uint32_t *ctrl = &dma->regs[DMA_CTRL];
+    if (op == OP_READ) {
+        *data = dma->regs[offset];
+    } else if (op == OP_WRITE) {
+        if (*ctrl & DMA_BUSY)
+            return 0;
+
+        if (offset != DMA_CTRL) {
+            dma->regs[offset] = *data;
+        } else if (*data & DMA_GO) {
+            // the transfer is begun by dma_cycle(), which is called next
+            *ctrl = DMA_BUSY | (*data & DMA_FILL);
+            dma->done = 0;
+            dma->last = s->machine.cycles;
+        } else {
+            *ctrl = 0;
+        }
+    } else {
+        return 1;
+    }
+
+    return 0;
+}
+
+static int dma_access(struct sim_state *s, int op, uint32_t addr, uint32_t count,
+        uint32_t *buf)
+{
+    if (s->dispatch_block)
+        return s->dispatch_block(s, op, addr, count, buf);
+
+    int rc = 0;
+    for (uint32_t i = 0; i < count && !rc; i++)
+        rc = s->dispatch_op(s, op, (addr + i) & PTR_MASK, &buf[i]);
+
+    return rc;
+}
+
+// moves up to count words of the current transfer
+static int dma_move(struct sim_state *s, struct dma_state *dma, uint32_t count)
+{
+    uint32_t buf[DMA_CHUNK];
+    int fill = dma->regs[DMA_CTRL] & DMA_FILL;
+
+    while (count > 0) {
+        uint32_t n = MIN(count, DMA_CHUNK);
+        uint32_t src = (dma->regs[DMA_SRC] + dma->done) & PTR_MASK;
+        uint32_t dst = (dma->regs[DMA_DST] + dma->done) & PTR_MASK;
+        // pieces do not wrap around the address space
+        if (!fill)
+            n = MIN(n, PTR_MASK + 1 - src);
+        n = MIN(n, PTR_MASK + 1 - dst);
+
+        if (fill) {
+            for (uint32_t i = 0; i < n; i++)
+                buf[i] = dma->regs[DMA_SRC];
+        } else if (dma_access(s, OP_READ, src, n, buf)) {
+            return 1;
+        }
+
+        if (dma_access(s, OP_WRITE, dst, n, buf))
+            return 1;
+        // the words written may be code that has already run
+        sim_note_write(s, dst, n);
+
+        dma->done += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+static int dma_cycle(struct sim_state *s, void *cookie, uint64_t now,
+        uint64_t *next)
+{
+    struct dma_state *dma = cookie;
+    uint32_t *ctrl = &dma->regs[DMA_CTRL];
+
+    if (*ctrl & DMA_BUSY) {
+        uint32_t remaining = dma->regs[DMA_LEN] - dma->done;
+        uint64_t budget = (now - dma->last) * dma->rate;
+        dma->last = now;
+        if (dma_move(s, dma, MIN(remaining, budget)))
+            *ctrl = (*ctrl & ~DMA_BUSY) | DMA_ERROR;
+        else if (dma->done == dma->regs[DMA_LEN])
+            *ctrl &= ~DMA_BUSY;
+    }
+
+    if (*ctrl & DMA_BUSY) {
+        // come back when the next chunk, or the last piece, can be moved
+        uint32_t words = MIN(dma->regs[DMA_LEN] - dma->done, DMA_CHUNK);
+        *next = now + (words + dma->rate - 1) / dma->rate;
+    } else {
+        *next = UINT64_MAX;
+    }
+
+    return 0;
+}
+
+static int dma_serialize(struct sim_state *s, void *cookie, FILE *out)
+{
+    struct dma_state *dma = cookie;
+    SNAPSHOT_PUT(dma->regs, out);
+    SNAPSHOT_PUT(dma->done, out);
+    SNAPSHOT_PUT(dma->last, out);
+    return 0;
+}
+
+static int dma_deserialize(struct sim_state *s, void *cookie, FILE *in)
+{
+    struct dma_state *dma = cookie;
+    SNAPSHOT_GET(dma->regs, in);
+    SNAPSHOT_GET(dma->done, in);
+    SNAPSHOT_GET(dma->last, in);
+    return 0;
+}
+
+int dma_add_device(struct device **device)
+{
+    **device = (struct device){
+        .bounds = { DMA_BASE, DMA_END },
+        .op = dma_op,
+        .init = dma_init,
+        .fini = dma_fini,
+        .cycle = dma_cycle,
+        .serialize = dma_serialize,
+        .deserialize = dma_deserialize,
+    };
+
+    return 0;
+}
+
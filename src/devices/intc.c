@@ -0,0 +1,109 @@
+// An interrupt controller, which makes the simulator's interrupt state visible
+// to programs. Registers :
+//   INTC_BASE + 0 : pending lines ; writing clears the lines whose bits are set
+//   INTC_BASE + 1 : enabled lines
+//   INTC_BASE + 2 : control ; INTC_IE enables interrupts, from after the next
+//                   instruction, so that a handler can return with
+//                   `P <- INTC_SAVED` just after enabling them
+//   INTC_BASE + 3 : address of the handler
+//   INTC_BASE + 4 : value of P when the handler was entered
+//   INTC_BASE + 5 : wait ; writing stops the processor until an enabled line is
+//                   pending, letting time pass straight to the next device
+//                   event
+//   INTC_BASE + 6 : raise ; writing raises the lines whose bits are set
+// Entering the handler clears INTC_IE ; the handler saves any registers it
+// uses itself.
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "device.h"
+
+#define INTC_BASE   0x320
+#define INTC_END    (INTC_BASE + INTC_REGS - 1)
+
+enum { INTC_PENDING, INTC_ENABLED, INTC_CTRL, INTC_VECTOR, INTC_SAVED,
+       INTC_WAIT, INTC_RAISE, INTC_REGS };
+enum { INTC_IE = 1 };
+
+struct intc_state {
+    uint32_t base;
+};
+
+static int intc_init(struct sim_state *s, void *cookie, ...)
+{
+    va_list ap;
+    va_start(ap, cookie);
+    struct device *device = va_arg(ap, struct device *);
+    va_end(ap);
+
+    struct intc_state *intc = *(void**)cookie = malloc(sizeof *intc);
+    intc->base = device->bounds[0];
+
+    return 0;
+}
+
+static int intc_fini(struct sim_state *s, void *cookie)
+{
+    free(cookie);
+
+    return 0;
+}
+
+static int intc_op(struct sim_state *s, void *cookie, int op, uint32_t addr,
+        uint32_t *data)
+{
+    struct intc_state *intc = cookie;
+    struct irq_state *irq = &s->machine.irq;
+    assert(("Address within address space", !(addr & ~PTR_MASK)));
+
+    uint32_t offset = addr - intc->base;
+    if (op == OP_READ) {
+        switch (offset) {
+            case INTC_PENDING: *data = irq->pending; break;
+            case INTC_ENABLED: *data = irq->enabled; break;
+            case INTC_CTRL:    *data = irq->ie ? INTC_IE : 0; break;
+            case INTC_VECTOR:  *data = irq->vector; break;
+            case INTC_SAVED:   *data = irq->saved; break;
+            default:           *data = 0; break;
+        }
+    } else if (op == OP_WRITE) {
+        switch (offset) {
+            case INTC_PENDING: irq->pending &= ~*data; break;
+            case INTC_ENABLED: irq->enabled = *data; break;
+            case INTC_VECTOR:  irq->vector = *data; break;
+            case INTC_SAVED:   irq->saved = *data; break;
+            case INTC_WAIT:    irq->waiting = 1; break;
+            case INTC_RAISE:   irq->pending |= *data; break;
+            case INTC_CTRL:
+                if ((*data & INTC_IE) && !irq->ie) {
+                    // P already names the next instruction
+                    irq->shadow = s->machine.regs[15];
+                    irq->shadowed = 1;
+                }
+                irq->ie = !!(*data & INTC_IE);
+                break;
+        }
+        irq_update(irq);
+    } else {
+        return 1;
+    }
+
+    return 0;
+}
+
+int intc_add_device(struct device **device)
+{
+    **device = (struct device){
+        .bounds = { INTC_BASE, INTC_END },
+        .op = intc_op,
+        .init = intc_init,
+        .fini = intc_fini,
+    };
+
+    return 0;
+}
+
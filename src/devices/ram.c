@@ -1,4 +1,9 @@
+// MAP_ANON and MAP_NORESERVE are not in POSIX ; _GNU_SOURCE exposes them on
+// GNU/Linux, and they are available by default on apple-darwin
+#define _GNU_SOURCE 1
+
 #include <assert.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,18 +12,127 @@
 #include "device.h"
 #include "ram.h"
 
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define RAM_MMAP 1
+#endif
+
+// The whole memory space is reserved up front to simplify indexing, but the
+// host only provides storage for it as it is touched. Since fresh storage is
+// zeroed, a nonzero initial value is written to a page only when the page is
+// first written ; until then, it reads as the shared initial page.
 struct ram_state {
-    // for now, allocate the whole memory space even if we don't use all of it,
-    // to simplify indexing
-    int32_t mem[RAM_END + 1];
+    uint32_t *mem;          ///< RAM_END + 1 words
+    size_t size;            ///< bytes reserved for mem
+    uint32_t fill;          ///< initial value
+    int hugepages;          ///< whether to ask for transparent huge pages
+    /// bitmap of dispatch pages whose contents are in mem
+    unsigned char ready[DISPATCH_PAGES / CHAR_BIT];
+    uint32_t init[DISPATCH_PAGE_WORDS];     ///< shared contents of unready pages
 };
 
+#define READY(Ram,Page) ((Ram)->ready[(Page) / CHAR_BIT] & (1u << ((Page) % CHAR_BIT)))
+
+static void ram_set_ready(struct ram_state *ram, uint32_t page)
+{
+    ram->ready[page / CHAR_BIT] |= 1u << (page % CHAR_BIT);
+}
+
+// gives a page its own contents, returning its storage
+static uint32_t *ram_prepare(struct ram_state *ram, uint32_t page)
+{
+    uint32_t *mem = &ram->mem[page << DISPATCH_PAGE_BITS];
+    if (!READY(ram, page)) {
+        memcpy(mem, ram->init, sizeof ram->init);
+        ram_set_ready(ram, page);
+    }
+
+    return mem;
+}
+
+// Provides zeroed memory, at where if it is not NULL, and forgets which
+// pages hold their own contents.
+static void ram_reserve(struct ram_state *ram, void *where)
+{
+#if RAM_MMAP
+    void *got = mmap(where, ram->size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANON | MAP_NORESERVE | (where ? MAP_FIXED : 0), -1, 0);
+    if (got == MAP_FAILED)
+        fatal(PRINT_ERRNO, "Failed to reserve memory");
+    ram->mem = got;
+#if defined(MADV_HUGEPAGE)
+    if (ram->hugepages)
+        madvise(ram->mem, ram->size, MADV_HUGEPAGE);
+#endif
+#else
+    if (where)
+        memset(where, 0, ram->size);
+    else
+        ram->mem = calloc(1, ram->size);
+#endif
+    memset(ram->ready, ram->fill ? 0 : 0xff, sizeof ram->ready);
+}
+
+#if RAM_MMAP
+// Maps a raw image (host-endian words) privately over memory starting at
+// RAM_BASE, so that its pages are read from the file only as they are touched,
+// and copied only if they are written.
+static int ram_map_image(struct ram_state *ram, const char *name)
+{
+    int fd = open(name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st))
+        fatal(PRINT_ERRNO, "Failed to open RAM image `%s'", name);
+
+    size_t words = st.st_size / sizeof *ram->mem;
+    if (words > RAM_END + 1 - RAM_BASE)
+        fatal(0, "RAM image `%s' is larger than memory", name);
+
+    if (words) {
+        void *where = &ram->mem[RAM_BASE];
+        void *got = mmap(where, words * sizeof *ram->mem, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_FIXED, fd, 0);
+        if (got != where)
+            fatal(PRINT_ERRNO, "Failed to map RAM image `%s'", name);
+    }
+
+    close(fd);
+
+    uint32_t first = RAM_BASE >> DISPATCH_PAGE_BITS;
+    uint32_t last = (RAM_BASE + words + DISPATCH_PAGE_MASK) >> DISPATCH_PAGE_BITS;
+    for (uint32_t page = first; page < last; page++)
+        ram_set_ready(ram, page);
+    // the rest of the last page holds zeroes from the mapping, not the fill
+    for (size_t i = RAM_BASE + words; i < (size_t)last << DISPATCH_PAGE_BITS; i++)
+        ram->mem[i] = ram->fill;
+
+    return 0;
+}
+#endif
+
 static int ram_init(struct sim_state *s, void *cookie, ...)
 {
-    struct ram_state *ram = *(void**)cookie = malloc(sizeof *ram);
-    if (s->conf.should_init)
-        for (unsigned long i = 0; i < countof(ram->mem); i++)
-            ram->mem[i] = s->conf.initval;
+    struct ram_state *ram = *(void**)cookie = calloc(1, sizeof *ram);
+    ram->size = (RAM_END + 1) * sizeof *ram->mem;
+    ram->fill = s->conf.should_init ? s->conf.initval : 0;
+    for (unsigned long i = 0; i < countof(ram->init); i++)
+        ram->init[i] = ram->fill;
+
+    const char *val;
+    if (param_get(s, "ram.hugepages", &val))
+        ram->hugepages = !!strtol(val, NULL, 0);
+    ram_reserve(ram, NULL);
+
+    if (param_get(s, "ram.image", &val)) {
+#if RAM_MMAP
+        ram_map_image(ram, val);
+#else
+        fatal(0, "RAM images cannot be mapped on this platform");
+#endif
+    }
 
     return 0;
 }
@@ -26,6 +140,11 @@ static int ram_init(struct sim_state *s, void *cookie, ...)
 static int ram_fini(struct sim_state *s, void *cookie)
 {
     struct ram_state *ram = cookie;
+#if RAM_MMAP
+    munmap(ram->mem, ram->size);
+#else
+    free(ram->mem);
+#endif
     free(ram);
 
     return 0;
@@ -36,16 +155,115 @@ static int ram_op(struct sim_state *s, void *cookie, int op, uint32_t addr, uint
     struct ram_state *ram = cookie;
     assert(("Address within address space", !(addr & ~PTR_MASK)));
 
+    uint32_t page = addr >> DISPATCH_PAGE_BITS;
     if (op == OP_WRITE)
-        ram->mem[addr] = *data;
+        ram_prepare(ram, page)[addr & DISPATCH_PAGE_MASK] = *data;
     else if (op == OP_READ)
-        *data = ram->mem[addr];
+        *data = READY(ram, page) ? ram->mem[addr] : ram->fill;
     else
         return 1;
 
     return 0;
 }
 
+static int ram_read_block(struct sim_state *s, void *cookie, uint32_t addr,
+        uint32_t count, uint32_t *buf)
+{
+    struct ram_state *ram = cookie;
+
+    while (count > 0) {
+        uint32_t page = addr >> DISPATCH_PAGE_BITS;
+        uint32_t n = MIN(count, DISPATCH_PAGE_WORDS - (addr & DISPATCH_PAGE_MASK));
+        if (READY(ram, page))
+            memcpy(buf, &ram->mem[addr], n * sizeof *buf);
+        else
+            memcpy(buf, ram->init, n * sizeof *buf);
+
+        addr += n;
+        buf += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+static int ram_write_block(struct sim_state *s, void *cookie, uint32_t addr,
+        uint32_t count, const uint32_t *buf)
+{
+    struct ram_state *ram = cookie;
+
+    while (count > 0) {
+        uint32_t page = addr >> DISPATCH_PAGE_BITS;
+        uint32_t n = MIN(count, DISPATCH_PAGE_WORDS - (addr & DISPATCH_PAGE_MASK));
+        memcpy(&ram_prepare(ram, page)[addr & DISPATCH_PAGE_MASK], buf, n * sizeof *buf);
+
+        addr += n;
+        buf += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+static uint32_t *ram_page(struct sim_state *s, void *cookie, uint32_t addr)
+{
+    struct ram_state *ram = cookie;
+    uint32_t page = addr >> DISPATCH_PAGE_BITS;
+    // the initial value is not yet in memory, so it must not be handed out
+    return READY(ram, page) ? &ram->mem[page << DISPATCH_PAGE_BITS] : NULL;
+}
+
+static const uint32_t *ram_page_shared(struct sim_state *s, void *cookie,
+        uint32_t addr)
+{
+    struct ram_state *ram = cookie;
+    return ram->init;
+}
+
+// Pages that hold only the initial value are left out of a snapshot. The
+// rest are written with their base addresses, followed by an invalid one.
+static int ram_serialize(struct sim_state *s, void *cookie, FILE *out)
+{
+    struct ram_state *ram = cookie;
+
+    for (uint32_t base = RAM_BASE; base < RAM_END; base += DISPATCH_PAGE_WORDS) {
+        if (!READY(ram, base >> DISPATCH_PAGE_BITS))
+            continue;
+
+        const uint32_t *page = &ram->mem[base];
+        uint32_t i = 0;
+        while (i < DISPATCH_PAGE_WORDS && page[i] == ram->fill)
+            i++;
+        if (i == DISPATCH_PAGE_WORDS)
+            continue;
+
+        SNAPSHOT_PUT(base, out);
+        snapshot_put(out, page, DISPATCH_PAGE_WORDS * sizeof *page);
+    }
+
+    uint32_t end = UINT32_MAX;
+    SNAPSHOT_PUT(end, out);
+
+    return 0;
+}
+
+static int ram_deserialize(struct sim_state *s, void *cookie, FILE *in)
+{
+    struct ram_state *ram = cookie;
+    // mapping afresh also drops any image mapped at startup
+    ram_reserve(ram, ram->mem);
+
+    uint32_t base;
+    for (SNAPSHOT_GET(base, in); base != UINT32_MAX; SNAPSHOT_GET(base, in)) {
+        if (base < RAM_BASE || base > RAM_END || base & DISPATCH_PAGE_MASK)
+            return 1;
+        snapshot_get(in, ram_prepare(ram, base >> DISPATCH_PAGE_BITS),
+                DISPATCH_PAGE_WORDS * sizeof *ram->mem);
+    }
+
+    return 0;
+}
+
 int ram_add_device(struct device **device)
 {
     **device = (struct device){
@@ -53,6 +271,12 @@ int ram_add_device(struct device **device)
         .op = ram_op,
         .init = ram_init,
         .fini = ram_fini,
+        .page = ram_page,
+        .page_shared = ram_page_shared,
+        .read_block = ram_read_block,
+        .write_block = ram_write_block,
+        .serialize = ram_serialize,
+        .deserialize = ram_deserialize,
     };
 
     return 0;
@@ -1,33 +1,229 @@
-#include <assert.h>
+// A serial port with receive and transmit buffers. Registers :
+//   SERIAL_BASE + 0 : data ; a write queues a character for output, and a read
+//                     takes the next character of input, waiting for one if
+//                     none is ready (past the end of input, a read gives -1)
+//   SERIAL_BASE + 1 : status (read-only) ; SERIAL_RX_READY if a read of data
+//                     would not wait, SERIAL_RX_EOF at the end of input, and
+//                     SERIAL_TX_FULL if a write would wait (never, here)
+// Reading the status never blocks, so a program can poll. Output is written in
+// large chunks : when the buffer fills, before input is waited or polled for,
+// and on exit (even after a fatal error) ; output to a terminal is also
+// written at the end of each line. Writes to the status register are ignored.
+//
+// By default the port is connected to stdin and stdout ; parameters serial.in
+// and serial.out name files to use instead, and serial.socket names a Unix
+// domain socket to connect to for both. Another instance named, for example,
+// serial1 takes serial1.in and so on instead.
+
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#if !defined(_WIN32)
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#define SERIAL_POLL 1
+#endif
 
 #include "common.h"
 #include "device.h"
 
 #define SERIAL_BASE (1ULL << 5)
+#define SERIAL_BUFFER 65536
+
+enum { SERIAL_DATA, SERIAL_STATUS };
+enum { SERIAL_RX_READY = 1, SERIAL_TX_FULL = 2, SERIAL_RX_EOF = 4 };
+
+struct serial_state {
+    struct serial_state *next;  ///< next open port, for serial_flush_all()
+    uint32_t base;          ///< address of the data register
+    int in, out;            ///< host file descriptors
+    int eof;                ///< whether in has reached its end
+    int lines;              ///< whether to write output a line at a time
+    size_t rx_pos, rx_len;  ///< input not yet read is rx[rx_pos..rx_len)
+    size_t tx_len;          ///< output queued in tx
+    unsigned char rx[SERIAL_BUFFER];
+    unsigned char tx[SERIAL_BUFFER];
+};
+
+/// ports not yet finished ; fatal() returns from main() without calling
+/// serial_fini(), so their output is written by an exit handler instead
+static struct serial_state *serial_ports;
+
+static int serial_flush(struct serial_state *serial);
+
+static void serial_flush_all(void)
+{
+    for (struct serial_state *serial = serial_ports; serial; serial = serial->next)
+        serial_flush(serial);
+}
+
+static int serial_open(const char *name, int flags)
+{
+    int fd = open(name, flags, 0666);
+    if (fd < 0)
+        fatal(PRINT_ERRNO, "Failed to open serial port stream `%s'", name);
+
+    return fd;
+}
+
+static int serial_connect(const char *name)
+{
+#if SERIAL_POLL
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(name) >= sizeof addr.sun_path)
+        fatal(0, "Serial port socket name `%s' is too long", name);
+    strcpy(addr.sun_path, name);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof addr))
+        fatal(PRINT_ERRNO, "Failed to connect serial port to `%s'", name);
+
+    return fd;
+#else
+    fatal(0, "Serial port sockets are not supported on this platform");
+#endif
+}
 
 static int serial_init(struct sim_state *s, void *cookie, ...)
 {
+    va_list ap;
+    va_start(ap, cookie);
+    struct device *device = va_arg(ap, struct device *);
+    va_end(ap);
+
+    struct serial_state *serial = *(void**)cookie = malloc(sizeof *serial);
+    serial->base = device->bounds[0];
+    serial->in = STDIN_FILENO;
+    serial->out = STDOUT_FILENO;
+    serial->eof = 0;
+    serial->rx_pos = serial->rx_len = serial->tx_len = 0;
+
+    const char *val;
+    if (device_param_get(s, device, "socket", &val))
+        serial->in = serial->out = serial_connect(val);
+    if (device_param_get(s, device, "in", &val))
+        serial->in = serial_open(val, O_RDONLY);
+    if (device_param_get(s, device, "out", &val))
+        serial->out = serial_open(val, O_WRONLY | O_CREAT | O_TRUNC);
+    serial->lines = isatty(serial->out);
+
+    static int registered;
+    if (!registered++)
+        atexit(serial_flush_all);
+    serial->next = serial_ports;
+    serial_ports = serial;
+
+    return 0;
+}
+
+static int serial_flush(struct serial_state *serial)
+{
+    // keep our output in order with anything the simulator prints
+    if (serial->out == STDOUT_FILENO)
+        fflush(stdout);
+
+    for (size_t done = 0; done < serial->tx_len; ) {
+        ssize_t n = write(serial->out, &serial->tx[done], serial->tx_len - done);
+        if (n < 0 && errno != EINTR)
+            return -1;
+        if (n > 0)
+            done += n;
+    }
+
+    serial->tx_len = 0;
+
     return 0;
 }
 
 static int serial_fini(struct sim_state *s, void *cookie)
 {
+    struct serial_state *serial = cookie;
+    serial_flush(serial);
+
+    struct serial_state **prev = &serial_ports;
+    while (*prev != serial)
+        prev = &(*prev)->next;
+    *prev = serial->next;
+
+    if (serial->in != STDIN_FILENO)
+        close(serial->in);
+    if (serial->out != STDOUT_FILENO && serial->out != serial->in)
+        close(serial->out);
+    free(serial);
+
     return 0;
 }
 
+// reads whatever input is available, waiting for some if wait is set
+static void serial_fill(struct serial_state *serial, int wait)
+{
+    if (serial->rx_pos < serial->rx_len || serial->eof)
+        return;
+
+#if SERIAL_POLL
+    struct pollfd p = { .fd = serial->in, .events = POLLIN };
+    if (!wait && poll(&p, 1, 0) <= 0)
+        return;
+#else
+    if (!wait)
+        return;
+#endif
+
+    ssize_t n;
+    do {
+        n = read(serial->in, serial->rx, sizeof serial->rx);
+    } while (n < 0 && errno == EINTR);
+
+    serial->rx_pos = 0;
+    serial->rx_len = n > 0 ? n : 0;
+    serial->eof = n <= 0;
+}
+
 static int serial_op(struct sim_state *s, void *cookie, int op, uint32_t addr, uint32_t *data)
 {
-    int tmp;
+    struct serial_state *serial = cookie;
+    int ready = serial->rx_pos < serial->rx_len;
 
     if (op == OP_WRITE) {
-        putchar(*data);
-    } else if (op == OP_READ) {
-        if ((*data = tmp = getchar()) && tmp == EOF) {
+        if (addr - serial->base != SERIAL_DATA)
+            return 0;
+
+        if (serial->tx_len == sizeof serial->tx && serial_flush(serial))
             return -1;
+        serial->tx[serial->tx_len++] = *data;
+        if (serial->lines && (*data & 0xff) == '\n' && serial_flush(serial))
+            return -1;
+    } else if (op == OP_READ && addr - serial->base == SERIAL_STATUS) {
+        if (!ready) {
+            // a program polling for input has usually just written a prompt
+            if (serial_flush(serial))
+                return -1;
+            serial_fill(serial, 0);
+            ready = serial->rx_pos < serial->rx_len;
+        }
+
+        *data = (ready ? SERIAL_RX_READY : 0) | (!ready && serial->eof ? SERIAL_RX_EOF : 0);
+    } else if (op == OP_READ) {
+        if (!ready) {
+            if (serial_flush(serial))
+                return -1;
+            serial_fill(serial, 1);
+            if (serial->eof) {
+                *data = 0xffffffff;
+                return -1;
+            }
         }
+
+        *data = serial->rx[serial->rx_pos++];
     } else {
         return 1;
     }
@@ -35,6 +231,41 @@ static int serial_op(struct sim_state *s, void *cookie, int op, uint32_t addr, u
     return 0;
 }
 
+// Output is written out before a snapshot is taken, so only unread input is
+// kept.
+static int serial_serialize(struct sim_state *s, void *cookie, FILE *out)
+{
+    struct serial_state *serial = cookie;
+    serial_flush(serial);
+
+    uint32_t len = serial->rx_len - serial->rx_pos;
+    uint8_t eof = serial->eof;
+    SNAPSHOT_PUT(eof, out);
+    SNAPSHOT_PUT(len, out);
+    snapshot_put(out, &serial->rx[serial->rx_pos], len);
+
+    return 0;
+}
+
+static int serial_deserialize(struct sim_state *s, void *cookie, FILE *in)
+{
+    struct serial_state *serial = cookie;
+
+    uint32_t len;
+    uint8_t eof;
+    SNAPSHOT_GET(eof, in);
+    SNAPSHOT_GET(len, in);
+    if (len > sizeof serial->rx)
+        return 1;
+
+    snapshot_get(in, serial->rx, len);
+    serial->rx_pos = 0;
+    serial->rx_len = len;
+    serial->eof = eof;
+
+    return 0;
+}
+
 int serial_add_device(struct device **device)
 {
     **device = (struct device){
@@ -42,6 +273,8 @@ int serial_add_device(struct device **device)
         .op = serial_op,
         .init = serial_init,
         .fini = serial_fini,
+        .serialize = serial_serialize,
+        .deserialize = serial_deserialize,
     };
 
     return 0;
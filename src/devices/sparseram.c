@@ -1,6 +1,5 @@
 #include <assert.h>
 #include <stdint.h>
-#include <search.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -8,91 +7,180 @@
 #include "device.h"
 #include "ram.h"
 
-// Allocate space by roughly a page-size (although since there is overhead the
-// fact that it is nearly a page size is basically useless since it does not
-// fit evenly into pages). Consider allocating header elements separately from
-// storage elements and packing nicely into pages.
-// TODO make sensitive to run-time page size ?
-#define PAGESIZE    4096
-#define PAGEWORDS   (PAGESIZE / sizeof(uint32_t))
-#define WORDMASK    ((1 << 10) - 1)
+// Pages are found through a table indexed by the upper bits of an address,
+// which covers the whole 24-bit address space with one slot per page, so a
+// lookup is two dependent loads. Each page is allocated exactly one page of
+// words when it is first written.
+#define PAGEBITS    10
+#define PAGEWORDS   (1u << PAGEBITS)
+#define WORDMASK    (PAGEWORDS - 1)
+#define PAGES       ((PTR_MASK >> PAGEBITS) + 1)
 
-struct sparseram_state {
-    void *mem;
-    void *userdata; ///< transient userdata, used for twalk() support
-};
+#if WORDMASK != DISPATCH_PAGE_MASK
+#error "sparseram_page() assumes that sparse pages are dispatch pages"
+#endif
 
-struct element {
-    int32_t base : 24;
-    struct sparseram_state *state;  ///< twalk() support
-    uint32_t space[];
+struct sparseram_state {
+    uint32_t *pages[PAGES];     ///< storage by page, or NULL if not written
+    uint32_t init[PAGEWORDS];   ///< shared contents of unwritten pages
 };
 
-static int tree_compare(const void *_a, const void *_b)
-{
-    const struct element *a = _a;
-    const struct element *b = _b;
-    return b->base - a->base;
-}
-
 static int sparseram_init(struct sim_state *s, void *cookie, ...)
 {
-    struct sparseram_state *sparseram = *(void**)cookie = malloc(sizeof *sparseram);
-    sparseram->mem = NULL;
+    struct sparseram_state *sparseram = *(void**)cookie = calloc(1, sizeof *sparseram);
+
+    uint32_t fill = s->conf.should_init ? s->conf.initval : 0;
+    for (unsigned long i = 0; i < countof(sparseram->init); i++)
+        sparseram->init[i] = fill;
 
     return 0;
 }
 
-TODO_TRAVERSE_(element)
+static void sparseram_clear(struct sparseram_state *sparseram)
+{
+    for (unsigned long i = 0; i < countof(sparseram->pages); i++) {
+        free(sparseram->pages[i]);
+        sparseram->pages[i] = NULL;
+    }
+}
 
 static int sparseram_fini(struct sim_state *s, void *cookie)
 {
     struct sparseram_state *sparseram = cookie;
-    // tdestroy() is a glibc extension. Here we generate a list of nodes to
-    // delete and then delete them one by one.
-    struct todo_node *todo = NULL;
-    sparseram->userdata = &todo;
-
-    tree_destroy(&todo, &sparseram->mem, traverse_element, tree_compare);
+    sparseram_clear(sparseram);
     free(sparseram);
 
     return 0;
 }
 
+// returns the page containing addr, or NULL if it has not been written
+static uint32_t *sparseram_find(struct sparseram_state *sparseram, uint32_t addr)
+{
+    return sparseram->pages[(addr & PTR_MASK) >> PAGEBITS];
+}
+
+// returns the page containing addr, allocating it from the shared initial
+// page if it has not been written
+static uint32_t *sparseram_alloc(struct sparseram_state *sparseram, uint32_t addr)
+{
+    uint32_t **p = &sparseram->pages[(addr & PTR_MASK) >> PAGEBITS];
+    if (!*p) {
+        *p = malloc(sizeof sparseram->init);
+        memcpy(*p, sparseram->init, sizeof sparseram->init);
+    }
+
+    assert(("Sparse page address is non-NULL", *p != NULL));
+    return *p;
+}
+
 static int sparseram_op(struct sim_state *s, void *cookie, int op, uint32_t addr,
         uint32_t *data)
 {
     struct sparseram_state *sparseram = cookie;
     assert(("Address within address space", !(addr & ~PTR_MASK)));
 
-    struct element key = (struct element){ addr & ~WORDMASK, NULL };
-    struct element **p = tsearch(&key, &sparseram->mem, tree_compare);
-    if (*p == &key) {
-        // Currently, a page is allocated even on a read. It is not a very
-        // useful optimisation, but we could avoid allocating a page until the
-        // first write.
-        struct element *node = malloc(PAGESIZE * sizeof *node->space + sizeof *node);
-        if (s->conf.should_init)
-            for (unsigned long i = 0; i < PAGESIZE; i++)
-                node->space[i] = s->conf.initval;
-
-        *node = (struct element){ addr & ~WORDMASK, cookie };
-        *p = node;
+    // Pages are allocated only when they are first written ; until then they
+    // read as the shared initial page.
+    uint32_t *page = sparseram_find(sparseram, addr);
+
+    if (op == OP_WRITE) {
+        if (!page)
+            page = sparseram_alloc(sparseram, addr);
+        page[addr & WORDMASK] = *data;
+    } else if (op == OP_READ) {
+        *data = (page ? page : sparseram->init)[addr & WORDMASK];
+    } else {
+        return 1;
     }
 
-    assert(("Sparse page address is non-NULL", *p != NULL));
-    uint32_t *where = &(*p)->space[addr & WORDMASK];
+    return 0;
+}
 
-    if (op == OP_WRITE)
-        *where = *data;
-    else if (op == OP_READ)
-        *data = *where;
-    else
-        return 1;
+static int sparseram_read_block(struct sim_state *s, void *cookie, uint32_t addr,
+        uint32_t count, uint32_t *buf)
+{
+    struct sparseram_state *sparseram = cookie;
+
+    while (count > 0) {
+        uint32_t n = MIN(count, PAGEWORDS - (addr & WORDMASK));
+        const uint32_t *page = sparseram_find(sparseram, addr);
+        memcpy(buf, &(page ? page : sparseram->init)[addr & WORDMASK], n * sizeof *buf);
+
+        addr += n;
+        buf += n;
+        count -= n;
+    }
 
     return 0;
 }
 
+static int sparseram_write_block(struct sim_state *s, void *cookie, uint32_t addr,
+        uint32_t count, const uint32_t *buf)
+{
+    struct sparseram_state *sparseram = cookie;
+
+    while (count > 0) {
+        uint32_t n = MIN(count, PAGEWORDS - (addr & WORDMASK));
+        uint32_t *page = sparseram_alloc(sparseram, addr);
+        memcpy(&page[addr & WORDMASK], buf, n * sizeof *buf);
+
+        addr += n;
+        buf += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+static uint32_t *sparseram_page(struct sim_state *s, void *cookie, uint32_t addr)
+{
+    // the shared initial page must not be handed out, since callers write
+    // through what is returned
+    return sparseram_find(cookie, addr);
+}
+
+// Allocated pages are written with their base addresses, followed by an
+// invalid one.
+static int sparseram_serialize(struct sim_state *s, void *cookie, FILE *out)
+{
+    struct sparseram_state *sparseram = cookie;
+    for (uint32_t i = 0; i < countof(sparseram->pages); i++) {
+        if (!sparseram->pages[i])
+            continue;
+
+        uint32_t base = i << PAGEBITS;
+        SNAPSHOT_PUT(base, out);
+        snapshot_put(out, sparseram->pages[i], sizeof sparseram->init);
+    }
+
+    uint32_t end = UINT32_MAX;
+    SNAPSHOT_PUT(end, out);
+
+    return 0;
+}
+
+static int sparseram_deserialize(struct sim_state *s, void *cookie, FILE *in)
+{
+    struct sparseram_state *sparseram = cookie;
+    sparseram_clear(sparseram);
+
+    uint32_t base;
+    for (SNAPSHOT_GET(base, in); base != UINT32_MAX; SNAPSHOT_GET(base, in)) {
+        if (base < RAM_BASE || base > RAM_END || base & WORDMASK)
+            return 1;
+        snapshot_get(in, sparseram_alloc(sparseram, base), sizeof sparseram->init);
+    }
+
+    return 0;
+}
+
+static const uint32_t *sparseram_page_shared(struct sim_state *s, void *cookie,
+        uint32_t addr)
+{
+    struct sparseram_state *sparseram = cookie;
+    return sparseram->init;
+}
+
 int sparseram_add_device(struct device **device)
 {
     **device = (struct device){
@@ -100,6 +188,12 @@ int sparseram_add_device(struct device **device)
         .op = sparseram_op,
         .init = sparseram_init,
         .fini = sparseram_fini,
+        .page = sparseram_page,
+        .page_shared = sparseram_page_shared,
+        .read_block = sparseram_read_block,
+        .write_block = sparseram_write_block,
+        .serialize = sparseram_serialize,
+        .deserialize = sparseram_deserialize,
     };
 
     return 0;
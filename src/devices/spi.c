@@ -4,12 +4,14 @@
 // simulated in any special way) to a spi_ops implementation. If param
 // "spi.impl" is set, a spi_ops implementation with that stem name is loaded
 // using dlsym(). Otherwise, acts as if nothing is attached to the SPI pins.
+// Another instance named, for example, spi1 takes spi1.impl instead.
 
 // _GNU_SOURCE is needed for RTLD_DEFAULT on GNU/Linux, although that flag
 // works on apple-darwin as well
 #define _GNU_SOURCE 1
 
 #include <assert.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,6 +34,7 @@
 #define SPI_INIT_CYCLES 3 /* TODO justify this number */
 
 struct spi_state {
+    uint32_t base;      // address of the first register
     struct spi_ops impls[NINST];
     void *impl_cookies[NINST];
     enum {
@@ -42,6 +45,7 @@ struct spi_state {
         SPI_EMU_DONE
     } state;
     unsigned dividend;  // how far into division in wishbone cycles
+    uint64_t last;      // machine cycle up to which dividend is counted
     unsigned cyc;       // how far into transaction in SPI cycles
     unsigned remaining; // how many bits remain to be transferred
 
@@ -103,20 +107,30 @@ static void spi_reset_defaults(struct spi_state *spi)
 
 static int spi_emu_init(struct sim_state *s, void *cookie, ...)
 {
-    struct spi_state *spi = *(void**)cookie = malloc(sizeof *spi);
+    va_list ap;
+    va_start(ap, cookie);
+    struct device *device = va_arg(ap, struct device *);
+    va_end(ap);
+
+    struct spi_state *spi = *(void**)cookie = calloc(1, sizeof *spi);
+    spi->base = device->bounds[0];
 
     spi_reset_defaults(spi);
+    spi->state = SPI_EMU_RESET;
+    spi->dividend = 0;
+    spi->cyc = 0;
+    spi->last = 0;
 
     memset(spi->impls, 0, sizeof spi->impls);
 
     const char *implname = NULL;
-    if (param_get(s, "spi.impl", &implname)) {
+    if (device_param_get(s, device, "impl", &implname)) {
         int inst = 0; // TODO support more than one instance
         // If implname contains a slash, treat it as a path ; otherwise, stem
         char buf[256];
         const char *implpath = NULL;
         const char *implstem = NULL;
-        param_get(s, "spi.implstem", &implstem); // may not be set ; that's OK
+        device_param_get(s, device, "implstem", &implstem); // may not be set ; that's OK
         if (strchr(implname, PATH_SEPARATOR_CHAR)) {
             implpath = implname;
         } else {
@@ -159,6 +173,8 @@ static int spi_emu_init(struct sim_state *s, void *cookie, ...)
         GET_CB(init);
         GET_CB(select);
         GET_CB(fini);
+        GET_CB(serialize);
+        GET_CB(deserialize);
 
         if (spi->impls[inst].init)
             if (spi->impls[inst].init(&spi->impl_cookies[inst]))
@@ -185,22 +201,39 @@ static int spi_emu_fini(struct sim_state *s, void *cookie)
     return 0;
 }
 
+// Catches up to machine cycle now while no transfer is in progress, when SPI
+// cycles only count. We are not called back while idle, so this is done in one
+// step rather than a period at a time.
+static void spi_idle_until(struct spi_state *spi, uint64_t now)
+{
+    unsigned period = (spi->regs.fmt.DIVIDER + 1) * 2;
+    // a dividend beyond the period (after DIVIDER shrank) ends it at once
+    uint64_t total = MIN(spi->dividend, period - 1) + (now - spi->last);
+
+    spi->cyc += total / period;
+    spi->dividend = total % period;
+    spi->last = now;
+}
+
 static int spi_op(struct sim_state *s, void *cookie, int op, uint32_t addr,
         uint32_t *data)
 {
     struct spi_state *spi = cookie;
-    uint32_t offset = addr - SPI_BASE;
+    uint32_t offset = addr - spi->base;
     int regnum = offset >> 2;
 
     assert(("Address within address space", !(addr & ~PTR_MASK)));
     assert(("Lower bits of offset are cleared", !(offset & 0x3)));
 
     // "When a transfer is in progress, writing to any register of the SPI
-    // Master core has no effect."
-    if (spi->state == SPI_EMU_RESET) {
-        if (op == OP_READ) {
-            *data = spi->regs.raw[regnum];
-        } else if (op == OP_WRITE) {
+    // Master core has no effect." Registers can always be read, though.
+    if (op == OP_READ) {
+        *data = spi->regs.raw[regnum];
+    } else if (spi->state == SPI_EMU_RESET) {
+        if (op == OP_WRITE) {
+            // the time spent idle passes before the write takes effect
+            spi_idle_until(spi, s->machine.cycles);
+
             if (offset == 0x10) { // CTRL register
                 uint32_t go_mask = 1 << 8;
                 uint32_t new_go_bit =  go_mask & *data;
@@ -353,19 +386,103 @@ static int spi_slave_cycle(struct spi_state *spi)
     return 0;
 }
 
-static int spi_emu_cycle(struct sim_state *s, void *cookie)
+static int spi_emu_cycle(struct sim_state *s, void *cookie, uint64_t now,
+        uint64_t *next)
 {
     struct spi_state *spi = cookie;
-    if (spi->dividend++ >= (unsigned)((spi->regs.fmt.DIVIDER + 1) * 2 - 1)) {
-        spi_slave_cycle(spi);
+    unsigned period = (spi->regs.fmt.DIVIDER + 1) * 2;
 
-        spi->cyc++;
-        spi->dividend = 0;
+    // nothing can happen until a register is written, which calls us again
+    if (spi->state == SPI_EMU_RESET) {
+        spi_idle_until(spi, now);
+        *next = UINT64_MAX;
+        return 0;
     }
 
+    // Catch up on the wishbone cycles since the last call. Nothing but the
+    // dividend changes until it reaches the end of a period, and we are called
+    // no later than that (or straight after a register is written).
+    for (uint64_t elapsed = now - spi->last; elapsed > 0; ) {
+        if (spi->dividend >= period - 1) {
+            spi_slave_cycle(spi);
+
+            spi->cyc++;
+            spi->dividend = 0;
+            elapsed--;
+        } else {
+            unsigned step = MIN(elapsed, period - 1 - spi->dividend);
+            spi->dividend += step;
+            elapsed -= step;
+        }
+    }
+
+    spi->last = now;
+    *next = now + (spi->dividend < period ? period - spi->dividend : 1);
+
     return 0;
 }
 
+static int spi_emu_serialize(struct sim_state *s, void *cookie, FILE *out)
+{
+    struct spi_state *spi = cookie;
+
+    uint32_t state = spi->state;
+    SNAPSHOT_PUT(state, out);
+    SNAPSHOT_PUT(spi->dividend, out);
+    SNAPSHOT_PUT(spi->last, out);
+    SNAPSHOT_PUT(spi->cyc, out);
+    SNAPSHOT_PUT(spi->remaining, out);
+    SNAPSHOT_PUT(spi->regs.raw, out);
+
+    // each attached instance's state is preceded by its size
+    for (int inst = 0; inst < NINST; inst++) {
+        struct spi_ops *ops = &spi->impls[inst];
+        uint32_t size = 0;
+        if (ops->serialize)
+            size = ops->serialize(spi->impl_cookies[inst], NULL, 0);
+        SNAPSHOT_PUT(size, out);
+        if (size) {
+            void *buf = malloc(size);
+            ops->serialize(spi->impl_cookies[inst], buf, size);
+            snapshot_put(out, buf, size);
+            free(buf);
+        }
+    }
+
+    return 0;
+}
+
+static int spi_emu_deserialize(struct sim_state *s, void *cookie, FILE *in)
+{
+    struct spi_state *spi = cookie;
+    int rc = 0;
+
+    uint32_t state;
+    SNAPSHOT_GET(state, in);
+    spi->state = state;
+    SNAPSHOT_GET(spi->dividend, in);
+    SNAPSHOT_GET(spi->last, in);
+    SNAPSHOT_GET(spi->cyc, in);
+    SNAPSHOT_GET(spi->remaining, in);
+    SNAPSHOT_GET(spi->regs.raw, in);
+
+    for (int inst = 0; inst < NINST; inst++) {
+        struct spi_ops *ops = &spi->impls[inst];
+        void *impl = spi->impl_cookies[inst];
+        uint32_t size;
+        SNAPSHOT_GET(size, in);
+        if (size) {
+            void *buf = malloc(size);
+            snapshot_get(in, buf, size);
+            if (!ops->deserialize || ops->deserialize(impl, buf, size))
+                rc = 1;
+            free(buf);
+        }
+    }
+
+    return rc;
+}
+
 int spi_add_device(struct device **device)
 {
     **device = (struct device){
@@ -374,6 +491,8 @@ int spi_add_device(struct device **device)
         .init = spi_emu_init,
         .fini = spi_emu_fini,
         .cycle = spi_emu_cycle,
+        .serialize = spi_emu_serialize,
+        .deserialize = spi_emu_deserialize,
     };
 
     return 0;
@@ -3,16 +3,24 @@
 
 #include "plugin.h"
 
+#include <stddef.h>
+
 typedef int EXPORT_CALLING spi_init(void *pcookie);
 typedef int EXPORT_CALLING spi_select(void *cookie, int _ss);
 typedef int EXPORT_CALLING spi_clock(void *cookie, int _ss, int in, int *out); ///< @p in and @c *out must be 0 or 1
 typedef int EXPORT_CALLING spi_fini(void *cookie);
+/// copies the state of an instance into @p buf if it fits, and returns its size
+typedef size_t EXPORT_CALLING spi_serialize(void *cookie, void *buf, size_t size);
+/// restores state from spi_serialize() ; returns nonzero if it is not valid
+typedef int EXPORT_CALLING spi_deserialize(void *cookie, const void *buf, size_t size);
 
 struct spi_ops {
     spi_init   *init;
     spi_select *select;
     spi_clock  *clock;
     spi_fini   *fini;
+    spi_serialize   *serialize;     ///< optional, for snapshots
+    spi_deserialize *deserialize;   ///< required if serialize is present
 };
 
 #endif
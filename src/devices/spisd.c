@@ -9,6 +9,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 #define RESET_CYCLE_REQ 50  ///< arbitrary
 
@@ -309,6 +310,26 @@ int EXPORT spisd_spi_clock(void *cookie, int _ss, int in, int *out)
     return 0;
 }
 
+size_t EXPORT spisd_spi_serialize(void *cookie, void *buf, size_t size)
+{
+    struct spisd_state *s = cookie;
+    if (size >= sizeof *s)
+        memcpy(buf, s, sizeof *s);
+
+    return sizeof *s;
+}
+
+int EXPORT spisd_spi_deserialize(void *cookie, const void *buf, size_t size)
+{
+    struct spisd_state *s = cookie;
+    if (size != sizeof *s)
+        return 1;
+
+    memcpy(s, buf, sizeof *s);
+
+    return 0;
+}
+
 int EXPORT spisd_spi_fini(void *cookie)
 {
     struct spisd_state *s = *(void**)cookie;
@@ -0,0 +1,146 @@
+// A timer, which counts machine cycles and raises an interrupt line when it
+// expires. Registers :
+//   TIMER_BASE + 0 : period in cycles
+//   TIMER_BASE + 1 : cycles left until the timer expires (read-only)
+//   TIMER_BASE + 2 : control ; writing TIMER_ON starts the timer afresh, which
+//                    stops after expiring once unless TIMER_REPEAT is also set
+//   TIMER_BASE + 3 : status ; TIMER_EXPIRED is set on expiry, and cleared by a
+//                    write
+// The line raised is given by parameter timer.irq (TIMER_IRQ by default).
+// Another instance named, for example, timer1 takes timer1.irq instead.
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "device.h"
+
+#define TIMER_BASE  0x330
+#define TIMER_END   (TIMER_BASE + TIMER_REGS - 1)
+#define TIMER_IRQ   0
+
+enum { TIMER_PERIOD, TIMER_LEFT, TIMER_CTRL, TIMER_STATUS, TIMER_REGS };
+enum { TIMER_ON = 1, TIMER_REPEAT = 2 };
+enum { TIMER_EXPIRED = 1 };
+
+struct timer_state {
+    uint32_t base;
+    uint32_t irq;       ///< interrupt line raised on expiry
+    uint32_t regs[TIMER_REGS];
+    uint64_t expiry;    ///< machine cycle at which the timer next expires
+};
+
+static int timer_init(struct sim_state *s, void *cookie, ...)
+{
+    va_list ap;
+    va_start(ap, cookie);
+    struct device *device = va_arg(ap, struct device *);
+    va_end(ap);
+
+    struct timer_state *timer = *(void**)cookie = calloc(1, sizeof *timer);
+    timer->base = device->bounds[0];
+    timer->irq = TIMER_IRQ;
+
+    const char *val;
+    if (device_param_get(s, device, "irq", &val))
+        timer->irq = strtoul(val, NULL, 0);
+    if (timer->irq >= 32)
+        fatal(0, "Parameter %s.irq must be less than 32", device->name);
+
+    return 0;
+}
+
+static int timer_fini(struct sim_state *s, void *cookie)
+{
+    free(cookie);
+
+    return 0;
+}
+
+static int timer_op(struct sim_state *s, void *cookie, int op, uint32_t addr,
+        uint32_t *data)
+{
+    struct timer_state *timer = cookie;
+    assert(("Address within address space", !(addr & ~PTR_MASK)));
+
+    uint32_t offset = addr - timer->base;
+    uint32_t *ctrl = &timer->regs[TIMER_CTRL];
+    if (op == OP_READ) {
+        if (offset == TIMER_LEFT && (*ctrl & TIMER_ON)) {
+            *data = timer->expiry - MIN(timer->expiry, s->machine.cycles);
+            // this changes every cycle, so a loop polling it is not idle
+            s->machine.volatile_loads = 1;
+        } else
+            *data = timer->regs[offset];
+    } else if (op == OP_WRITE) {
+        if (offset == TIMER_CTRL) {
+            *ctrl = *data & (TIMER_ON | TIMER_REPEAT);
+            // the write is counted once it completes
+            timer->expiry = s->machine.cycles + 1 + timer->regs[TIMER_PERIOD];
+        } else if (offset == TIMER_STATUS) {
+            timer->regs[TIMER_STATUS] = 0;
+        } else if (offset == TIMER_PERIOD) {
+            timer->regs[TIMER_PERIOD] = *data;
+        }
+    } else {
+        return 1;
+    }
+
+    return 0;
+}
+
+static int timer_cycle(struct sim_state *s, void *cookie, uint64_t now,
+        uint64_t *next)
+{
+    struct timer_state *timer = cookie;
+    uint32_t *ctrl = &timer->regs[TIMER_CTRL];
+    uint64_t period = timer->regs[TIMER_PERIOD];
+
+    if ((*ctrl & TIMER_ON) && now >= timer->expiry) {
+        timer->regs[TIMER_STATUS] |= TIMER_EXPIRED;
+        device_irq(s, timer->irq);
+        if (!(*ctrl & TIMER_REPEAT) || period == 0)
+            *ctrl &= ~TIMER_ON;
+        else
+            // expiries missed while we were not called are not made up
+            timer->expiry = now + period - (now - timer->expiry) % period;
+    }
+
+    *next = (*ctrl & TIMER_ON) ? timer->expiry : UINT64_MAX;
+
+    return 0;
+}
+
+static int timer_serialize(struct sim_state *s, void *cookie, FILE *out)
+{
+    struct timer_state *timer = cookie;
+    SNAPSHOT_PUT(timer->regs, out);
+    SNAPSHOT_PUT(timer->expiry, out);
+    return 0;
+}
+
+static int timer_deserialize(struct sim_state *s, void *cookie, FILE *in)
+{
+    struct timer_state *timer = cookie;
+    SNAPSHOT_GET(timer->regs, in);
+    SNAPSHOT_GET(timer->expiry, in);
+    return 0;
+}
+
+int timer_add_device(struct device **device)
+{
+    **device = (struct device){
+        .bounds = { TIMER_BASE, TIMER_END },
+        .op = timer_op,
+        .init = timer_init,
+        .fini = timer_fini,
+        .cycle = timer_cycle,
+        .serialize = timer_serialize,
+        .deserialize = timer_deserialize,
+    };
+
+    return 0;
+}
+
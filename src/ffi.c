@@ -33,6 +33,8 @@ int tf_run_until(struct sim_state *s, uint32_t start_address, int flags, cont_pr
 
         if (run_instruction(s, &i))
             return -1;
+        if (s->run_ops && run_events(s, s->run_ops))
+            return -1;
     } while (!(rc = stop(&s->machine, cud)));
 
     return rc;
@@ -0,0 +1,640 @@
+// A server for the GDB remote serial protocol, so that tsim can be driven by
+// gdb and other front ends that speak it, as an alternative to the prompt in
+// debugger_step(). It listens on a TCP port (on the loopback interface) or on
+// a Unix domain socket, and serves one client until it detaches or kills the
+// program.
+//
+// GDB addresses bytes, but tenyr addresses words, so byte address N names
+// byte N % 4 (counting from the least significant) of the word at N / 4. The
+// same goes for P, which is shown as a byte address ; the other registers are
+// shown as they are. Breakpoints, watchpoints and reverse execution are those
+// of the command-line debugger. As there, devices act and interrupts are taken
+// between instructions just as they are without a debugger.
+
+#define _XOPEN_SOURCE 600
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if !defined(_WIN32)
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#define GDB_SOCKETS 1
+#endif
+
+#include "common.h"
+#include "debugger_global.h"
+#include "ffi.h"
+#include "sim.h"
+#include "undo.h"
+
+#if GDB_SOCKETS
+
+/// longest packet we accept or send, not counting framing
+#define GDB_PACKET      16384
+/// instructions run between checks for an interrupt from the client
+#define GDB_POLL_EVERY  (1u << 16)
+
+enum gdb_signal { GDB_SIGINT = 2, GDB_SIGTRAP = 5 };
+
+struct gdb_conn {
+    int fd;
+    size_t pos, len;        ///< input not yet consumed is in[pos..len)
+    unsigned char in[GDB_PACKET];
+    char pkt[GDB_PACKET + 1];   ///< the packet last received
+    char out[GDB_PACKET + 1];   ///< the reply being built
+    char frame[GDB_PACKET + 4]; ///< the reply as sent, in a single write
+
+    struct debugger_data dd;
+    unsigned polls;         ///< instructions until we next look for an interrupt
+    int interrupted;        ///< whether the client interrupted the program
+    int exited;             ///< whether the program has halted
+};
+
+static const char hex[] = "0123456789abcdef";
+
+static const char target_xml[] =
+    "<?xml version=\"1.0\"?>"
+    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+    "<target version=\"1.0\">"
+    "<feature name=\"org.tenyr.core\">"
+    #define REG(Name,Type) "<reg name=\"" Name "\" bitsize=\"32\" type=\"" Type "\"/>"
+    REG("a","int") REG("b","int") REG("c","int") REG("d","int")
+    REG("e","int") REG("f","int") REG("g","int") REG("h","int")
+    REG("i","int") REG("j","int") REG("k","int") REG("l","int")
+    REG("m","int") REG("n","int") REG("o","data_ptr") REG("p","code_ptr")
+    #undef REG
+    "</feature>"
+    "</target>";
+
+// returns a socket listening on where, setting *path if it is a Unix domain
+// socket (which has a name to remove)
+static int gdb_listen(const char *where, int *path)
+{
+    int fd;
+    char *end;
+    long port = strtol(where, &end, 10);
+
+    *path = !*where || *end;
+    if (!*path) {
+        struct sockaddr_in addr = {
+            .sin_family = AF_INET,
+            .sin_port = htons(port),
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        };
+        int yes = 1;
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0 || port <= 0 || port > 65535
+                || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes)
+                || bind(fd, (struct sockaddr*)&addr, sizeof addr))
+            fatal(PRINT_ERRNO, "Failed to listen for GDB on port `%s'", where);
+    } else {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        if (strlen(where) >= sizeof addr.sun_path)
+            fatal(0, "GDB socket name `%s' is too long", where);
+        strcpy(addr.sun_path, where);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof addr))
+            fatal(PRINT_ERRNO, "Failed to listen for GDB on `%s'", where);
+    }
+
+    if (listen(fd, 1))
+        fatal(PRINT_ERRNO, "Failed to listen for GDB on `%s'", where);
+
+    return fd;
+}
+
+// returns the next byte from the client, or -1 at the end of input
+static int gdb_getc(struct gdb_conn *c)
+{
+    while (c->pos == c->len) {
+        ssize_t n = read(c->fd, c->in, sizeof c->in);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        c->pos = 0;
+        c->len = n;
+    }
+
+    return c->in[c->pos++];
+}
+
+static int gdb_write(struct gdb_conn *c, const char *buf, size_t len)
+{
+    for (size_t done = 0; done < len; ) {
+        ssize_t n = write(c->fd, &buf[done], len - done);
+        if (n < 0 && errno != EINTR)
+            return -1;
+        if (n > 0)
+            done += n;
+    }
+
+    return 0;
+}
+
+// sends c->out as a packet, until the client acknowledges it
+static int gdb_send(struct gdb_conn *c)
+{
+    size_t len = strlen(c->out);
+    unsigned char sum = 0;
+    for (size_t i = 0; i < len; i++)
+        sum += (unsigned char)c->out[i];
+
+    c->frame[0] = '$';
+    memcpy(&c->frame[1], c->out, len);
+    memcpy(&c->frame[len + 1], (char[]){ '#', hex[sum >> 4], hex[sum & 15] }, 3);
+
+    int ack;
+    do {
+        if (gdb_write(c, c->frame, len + 4))
+            return -1;
+        // anything else here (an interrupt, say) is not a reply to us
+        while ((ack = gdb_getc(c)) != '+' && ack != '-' && ack != -1)
+            ;
+    } while (ack == '-');
+
+    return ack == -1 ? -1 : 0;
+}
+
+static int hexval(int ch)
+{
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+// reads the next packet into c->pkt, acknowledging it ; returns -1 at the end
+// of input
+static int gdb_recv(struct gdb_conn *c)
+{
+    for (;;) {
+        int ch;
+        // interrupts and acknowledgements out of turn are ignored here
+        while ((ch = gdb_getc(c)) != '$')
+            if (ch == -1)
+                return -1;
+
+        size_t len = 0;
+        unsigned char sum = 0;
+        while ((ch = gdb_getc(c)) != '#' && ch != -1) {
+            sum += ch;
+            if (len < GDB_PACKET)
+                c->pkt[len++] = ch;
+        }
+        c->pkt[len] = '\0';
+
+        int hi = gdb_getc(c), lo = gdb_getc(c);
+        if (ch == -1 || lo == -1)
+            return -1;
+
+        int good = hexval(hi) >= 0 && hexval(lo) >= 0
+                && (hexval(hi) << 4 | hexval(lo)) == sum && len < GDB_PACKET;
+        if (gdb_write(c, good ? "+" : "-", 1))
+            return -1;
+        if (good)
+            return 0;
+    }
+}
+
+static char *put_byte(char *out, unsigned byte)
+{
+    *out++ = hex[(byte >> 4) & 15];
+    *out++ = hex[byte & 15];
+    *out = '\0';
+
+    return out;
+}
+
+// appends the bytes of word, least significant first
+static char *put_word(char *out, uint32_t word)
+{
+    for (int i = 0; i < 4; i++, word >>= 8)
+        out = put_byte(out, word);
+
+    return out;
+}
+
+// parses up to count bytes of hex from *in into buf, as put_word() wrote them ;
+// returns the number of bytes parsed
+static size_t get_bytes(const char **in, size_t count, unsigned char *buf)
+{
+    size_t n = 0;
+    const char *p = *in;
+    for (; n < count && hexval(p[0]) >= 0 && hexval(p[1]) >= 0; n++, p += 2)
+        buf[n] = hexval(p[0]) << 4 | hexval(p[1]);
+
+    *in = p;
+    return n;
+}
+
+static uint32_t get_word(const char **in)
+{
+    unsigned char b[4] = { 0 };
+    get_bytes(in, 4, b);
+
+    return b[0] | b[1] << 8 | b[2] << 16 | (uint32_t)b[3] << 24;
+}
+
+static uint32_t get_reg(struct sim_state *s, int n)
+{
+    uint32_t val = s->machine.regs[n];
+    return n == 15 ? val * 4 : val;
+}
+
+static void set_reg(struct sim_state *s, int n, uint32_t val)
+{
+    // A is always zero
+    if (n == 15)
+        s->machine.regs[n] = (val / 4) & PTR_MASK;
+    else if (n != 0)
+        s->machine.regs[n] = val;
+}
+
+// reads count words at addr, as many at once as we can ; returns the number
+// of words read, which is short only if a word could not be read
+static uint32_t read_words(struct sim_state *s, uint32_t addr, uint32_t count,
+        uint32_t *buf)
+{
+    if (s->dispatch_block && !s->dispatch_block(s, OP_READ, addr, count, buf))
+        return count;
+
+    uint32_t n = 0;
+    while (n < count && !s->dispatch_op(s, OP_READ, (addr + n) & PTR_MASK, &buf[n]))
+        n++;
+
+    return n;
+}
+
+static void read_memory(struct gdb_conn *c, uint32_t start, uint32_t len)
+{
+    struct sim_state *s = c->dd.s;
+    uint32_t buf[GDB_PACKET / 8 + 2];
+    len = MIN(len, GDB_PACKET / 2);
+
+    uint32_t first = start / 4, last = (start + len - 1) / 4;
+    if (len == 0 || last < first || last > PTR_MASK) {
+        strcpy(c->out, len ? "E01" : "");
+        return;
+    }
+
+    uint32_t got = read_words(s, first, last - first + 1, buf);
+    uint32_t end = MIN(start + len, (first + got) * 4);
+    char *out = c->out;
+    *out = '\0';
+    for (uint32_t b = start; b < end; b++)
+        out = put_byte(out, buf[b / 4 - first] >> (b % 4 * 8));
+
+    if (end <= start)
+        strcpy(c->out, "E01");
+}
+
+static void write_memory(struct gdb_conn *c, uint32_t start, uint32_t len,
+        const char *data)
+{
+    struct sim_state *s = c->dd.s;
+    unsigned char bytes[GDB_PACKET / 2];
+    if (len > sizeof bytes || start + len < start
+            || get_bytes(&data, len, bytes) != len) {
+        strcpy(c->out, "E01");
+        return;
+    }
+
+    for (uint32_t b = start; b < start + len; ) {
+        uint32_t addr = b / 4, word = 0;
+        if (addr > PTR_MASK) {
+            strcpy(c->out, "E01");
+            return;
+        }
+
+        // only a partial word need be read first
+        int whole = b % 4 == 0 && start + len - b >= 4;
+        if (!whole && s->dispatch_op(s, OP_READ, addr, &word)) {
+            strcpy(c->out, "E01");
+            return;
+        }
+
+        for (; b < start + len && b / 4 == addr; b++) {
+            uint32_t shift = b % 4 * 8;
+            word = (word & ~(0xffu << shift)) | (uint32_t)bytes[b - start] << shift;
+        }
+
+        if (s->dispatch_op(s, OP_WRITE, addr, &word)) {
+            strcpy(c->out, "E01");
+            return;
+        }
+        sim_note_write(s, addr, 1);
+    }
+
+    strcpy(c->out, "OK");
+}
+
+// stops tf_run_until() where the debugger would, or when the client sends an
+// interrupt
+static int gdb_stops(struct machine_state *m, void *cud)
+{
+    struct gdb_conn *c = cud;
+    if (tdbg_stops(m, &c->dd))
+        return 1;
+
+    if (--c->polls > 0)
+        return 0;
+
+    c->polls = GDB_POLL_EVERY;
+    struct pollfd p = { .fd = c->fd, .events = POLLIN };
+    while (c->pos == c->len && poll(&p, 1, 0) > 0) {
+        ssize_t n = read(c->fd, c->in, sizeof c->in);
+        if (n <= 0)
+            return c->interrupted = 1;
+        c->pos = 0;
+        c->len = n;
+    }
+
+    while (c->pos < c->len && !c->interrupted)
+        c->interrupted = c->in[c->pos++] == 0x03;
+
+    return c->interrupted;
+}
+
+// describes in c->out why the program stopped
+static void stop_reply(struct gdb_conn *c, int sig)
+{
+    struct watch_hit *hit = &c->dd.hit;
+    if (c->interrupted) {
+        sprintf(c->out, "S%02x", GDB_SIGINT);
+    } else if (hit->wp) {
+        static const char *names[] = {
+            [WATCH_READ  ] = "rwatch",
+            [WATCH_WRITE ] = "watch",
+            [WATCH_ACCESS] = "awatch",
+        };
+        sprintf(c->out, "T%02x%s:%lx;", GDB_SIGTRAP, names[hit->wp->type],
+                (long unsigned)hit->addr * 4);
+    } else {
+        sprintf(c->out, "S%02x", sig);
+    }
+
+    hit->wp = NULL;
+    c->interrupted = 0;
+}
+
+// sets P from the optional byte address at args
+static void resume_at(struct gdb_conn *c, const char *args)
+{
+    if (*args) {
+        set_reg(c->dd.s, 15, strtoul(args, NULL, 16));
+        undo_clear(c->dd.s->undo);
+    }
+}
+
+static void run(struct gdb_conn *c, int step)
+{
+    struct sim_state *s = c->dd.s;
+    int32_t *ip = &s->machine.regs[15];
+    int rc;
+
+    if (step) {
+        struct instruction i;
+        s->dispatch_op(s, OP_READ, *ip, &i.u.word);
+        rc = run_instruction(s, &i) ||
+            (s->run_ops && run_events(s, s->run_ops)) ? -1 : 0;
+    } else {
+        c->polls = GDB_POLL_EVERY;
+        rc = tf_run_until(s, *ip, TF_IGNORE_FIRST_PREDICATE, gdb_stops, c);
+    }
+
+    if (rc < 0) {
+        c->exited = 1;
+        strcpy(c->out, "W00");
+    } else {
+        stop_reply(c, GDB_SIGTRAP);
+    }
+}
+
+static void run_backwards(struct gdb_conn *c, int step)
+{
+    int rc = step ? undo_step(c->dd.s) : tdbg_reverse_continue(&c->dd);
+    if (rc > 0)
+        sprintf(c->out, "T%02xreplaylog:begin;", GDB_SIGTRAP);
+    else
+        stop_reply(c, GDB_SIGTRAP);
+}
+
+// handles Z and z packets : type 0 and 1 are breakpoints, and 2, 3 and 4 are
+// write, read and access watchpoints
+static void set_point(struct gdb_conn *c, int on, const char *args)
+{
+    static const int types[] = { [2] = WATCH_WRITE, WATCH_READ, WATCH_ACCESS };
+    char *end;
+    long type = strtol(args, &end, 16);
+    uint32_t addr = 0, len = 0;
+    if (*end == ',')
+        addr = strtoul(end + 1, &end, 16);
+    if (*end == ',')
+        len = strtoul(end + 1, &end, 16);
+
+    struct debugger_data *dd = &c->dd;
+    uint32_t word = (addr / 4) & PTR_MASK;
+    int rc = 0;
+    if (type < 0 || type > 4) {
+        c->out[0] = '\0';
+        return;
+    } else if (type < 2 && on) {
+        rc = tdbg_set_breakpoint(dd, word, 0, 0);
+    } else if (type < 2) {
+        rc = tdbg_delete_breakpoint(dd, word);
+    } else if (on) {
+        uint32_t words = len ? (addr + len - 1) / 4 - addr / 4 + 1 : 1;
+        rc = tdbg_set_watchpoint(dd, word, words, types[type]);
+    } else {
+        rc = tdbg_delete_watchpoint(dd, word, types[type]);
+    }
+
+    strcpy(c->out, rc ? "E01" : "OK");
+}
+
+// handles q packets
+static void query(struct gdb_conn *c, const char *q)
+{
+    static const char xfer[] = "Xfer:features:read:target.xml:";
+
+    if (!strncmp(q, "Supported", 9)) {
+        sprintf(c->out, "PacketSize=%x;qXfer:features:read+;"
+                "ReverseStep+;ReverseContinue+", GDB_PACKET);
+    } else if (!strncmp(q, xfer, sizeof xfer - 1)) {
+        char *end;
+        size_t off = strtoul(q + sizeof xfer - 1, &end, 16);
+        size_t len = *end == ',' ? strtoul(end + 1, NULL, 16) : 0;
+        size_t size = sizeof target_xml - 1;
+        off = MIN(off, size);
+        len = MIN(MIN(len, size - off), GDB_PACKET - 1);
+        sprintf(c->out, "%c%.*s", off + len < size ? 'm' : 'l', (int)len,
+                &target_xml[off]);
+    } else if (!strcmp(q, "Attached")) {
+        strcpy(c->out, "1");
+    } else if (!strcmp(q, "C")) {
+        strcpy(c->out, "QC1");
+    } else {
+        c->out[0] = '\0';
+    }
+}
+
+// handles the packet in c->pkt, leaving a reply in c->out ; returns nonzero
+// when the session is over
+static int handle(struct gdb_conn *c)
+{
+    struct sim_state *s = c->dd.s;
+    const char *args = &c->pkt[1];
+    char *out = c->out;
+    *out = '\0';
+
+    switch (c->pkt[0]) {
+        case '?':
+            if (c->exited)
+                strcpy(out, "W00");
+            else
+                sprintf(out, "S%02x", GDB_SIGTRAP);
+            break;
+        case 'g':
+            for (int i = 0; i < 16; i++)
+                out = put_word(out, get_reg(s, i));
+            break;
+        case 'G':
+            for (int i = 0; i < 16; i++)
+                set_reg(s, i, get_word(&args));
+            undo_clear(s->undo);
+            strcpy(out, "OK");
+            break;
+        case 'p': {
+            unsigned long n = strtoul(args, NULL, 16);
+            if (n < 16)
+                put_word(out, get_reg(s, n));
+            else
+                strcpy(out, "E01");
+            break;
+        }
+        case 'P': {
+            char *end;
+            unsigned long n = strtoul(args, &end, 16);
+            if (n < 16 && *end == '=') {
+                args = end + 1;
+                set_reg(s, n, get_word(&args));
+                undo_clear(s->undo);
+                strcpy(out, "OK");
+            } else {
+                strcpy(out, "E01");
+            }
+            break;
+        }
+        case 'm':
+        case 'M': {
+            char *end;
+            uint32_t addr = strtoul(args, &end, 16);
+            uint32_t len = *end == ',' ? strtoul(end + 1, &end, 16) : 0;
+            if (c->pkt[0] == 'm') {
+                read_memory(c, addr, len);
+            } else if (*end == ':') {
+                write_memory(c, addr, len, end + 1);
+                undo_clear(s->undo);
+            } else {
+                strcpy(out, "E01");
+            }
+            break;
+        }
+        case 'c':
+        case 's':
+            if (c->exited) {
+                strcpy(out, "W00");
+                break;
+            }
+            resume_at(c, args);
+            run(c, c->pkt[0] == 's');
+            break;
+        case 'b':
+            if ((args[0] == 's' || args[0] == 'c') && !args[1])
+                run_backwards(c, args[0] == 's');
+            break;
+        case 'Z':
+        case 'z':
+            set_point(c, c->pkt[0] == 'Z', args);
+            break;
+        case 'q':
+            query(c, args);
+            break;
+        case 'H':
+        case 'T':
+            strcpy(out, "OK");
+            break;
+        case 'D':
+            strcpy(out, "OK");
+            return 1;
+        case 'k':
+            c->exited = 1;
+            return 1;
+        default:
+            break;  // an empty reply means the packet is not supported
+    }
+
+    return 0;
+}
+
+int gdb_serve(struct sim_state *s, const char *where)
+{
+    int path;
+    int lfd = gdb_listen(where, &path);
+    fprintf(stderr, "Waiting for GDB on %s\n", where);
+
+    struct gdb_conn *c = calloc(1, sizeof *c);
+    do {
+        c->fd = accept(lfd, NULL, NULL);
+    } while (c->fd < 0 && errno == EINTR);
+    if (c->fd < 0)
+        fatal(PRINT_ERRNO, "Failed to accept a GDB connection on `%s'", where);
+
+    close(lfd);
+    if (path) {
+        unlink(where);  // nobody else can connect now
+    } else {
+        // packets are small, and each waits for the last to be acknowledged
+        int yes = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+    }
+
+    tdbg_init(&c->dd, s);
+    c->dd.quiet = 1;
+
+    int done = 0;
+    while (!done && !gdb_recv(c)) {
+        done = handle(c);
+        if (c->pkt[0] != 'k' && gdb_send(c))
+            break;
+    }
+
+    // a client that simply goes away is taken to have killed the program
+    int resume = done && !c->exited;
+
+    tdbg_fini(&c->dd);
+    close(c->fd);
+    free(c);
+
+    return resume;
+}
+
+#else
+
+int gdb_serve(struct sim_state *s, const char *where)
+{
+    fatal(0, "The GDB server is not supported on this platform");
+}
+
+#endif
+
@@ -0,0 +1,326 @@
+// Template translator from tenyr basic blocks to x86-64 code (System V calling
+// convention). Machine registers stay in memory at fixed offsets from %rbx ;
+// each instruction is computed in %eax, %ecx and %edx, and memory operations
+// call back into the simulator through jit_helpers.mem so that devices and
+// self-modifying code are handled exactly as the interpreter handles them.
+// Loads from plain memory, found through jit_helpers.page_mem, are made inline.
+
+// MAP_ANON is not in POSIX ; _GNU_SOURCE exposes it on GNU/Linux, and it is
+// available by default on apple-darwin
+#define _GNU_SOURCE 1
+
+#include "jit.h"
+#include "ops.h"
+#include "sim.h"
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+#include <sys/mman.h>
+
+// the longest sequence emitted for one instruction is well under this
+#define MAX_INSN_BYTES  192
+#define PROLOGUE_BYTES   32
+#define EPILOGUE_BYTES   32
+
+enum { EAX, ECX, EDX };
+
+struct jit {
+    unsigned char *base;
+    size_t size;
+    size_t used;
+};
+
+struct emitter {
+    unsigned char *p;
+    unsigned char *exit;        ///< shared exit sequence, once known
+    size_t fixups_count;
+    unsigned char *fixups[JIT_MAX_INSNS * 2];  ///< rel32 fields to aim at exit
+};
+
+#define EMIT(E,...) \
+    emit((E), sizeof (unsigned char[]){ __VA_ARGS__ }, \
+            (unsigned char[]){ __VA_ARGS__ })
+
+static void emit(struct emitter *e, size_t n, const unsigned char bytes[n])
+{
+    memcpy(e->p, bytes, n);
+    e->p += n;
+}
+
+static void emit32(struct emitter *e, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        *e->p++ = v >> (i * 8);
+}
+
+static void emit64(struct emitter *e, uint64_t v)
+{
+    for (int i = 0; i < 8; i++)
+        *e->p++ = v >> (i * 8);
+}
+
+// jnz to the exit sequence, which returns %eax
+static void emit_jnz_exit(struct emitter *e)
+{
+    EMIT(e, 0x0f, 0x85);                        // jnz rel32
+    e->fixups[e->fixups_count++] = e->p;
+    emit32(e, 0);
+}
+
+// host register h <- machine register r, as read by the instruction at addr
+static void emit_get_reg(struct emitter *e, int h, int r, uint32_t addr)
+{
+    if (r == 0) {
+        EMIT(e, 0x31, 0xc0 | h << 3 | h);       // xor h, h
+    } else if (r == 15) {
+        EMIT(e, 0xb8 + h);                      // mov h, imm32
+        emit32(e, addr + 1);
+    } else {
+        EMIT(e, 0x8b, 0x40 | h << 3 | 3, r * 4);// mov h, [rbx + 4r]
+    }
+}
+
+static void emit_set_reg(struct emitter *e, int r)
+{
+    if (r != 0)
+        EMIT(e, 0x89, 0x43, r * 4);             // mov [rbx + 4r], eax
+}
+
+static void emit_imm(struct emitter *e, int h, int32_t imm)
+{
+    EMIT(e, 0xb8 + h);                          // mov h, imm32
+    emit32(e, imm);
+}
+
+// calls the memory helper with the address in %eax
+static void emit_mem(struct emitter *e, const struct jit_helpers *h, int op)
+{
+    EMIT(e, 0x89, 0xc2);                        // mov edx, eax
+    EMIT(e, 0x4c, 0x89, 0xe7);                  // mov rdi, r12
+    EMIT(e, 0xbe);                              // mov esi, imm32
+    emit32(e, op);
+    EMIT(e, 0x48, 0xb8);                        // mov rax, imm64
+    emit64(e, (uintptr_t)h->mem);
+    EMIT(e, 0xff, 0xd0);                        // call rax
+    EMIT(e, 0x85, 0xc0);                        // test eax, eax
+    emit_jnz_exit(e);
+}
+
+// loads into %eax from the address in %eax, directly if it is plain memory
+static void emit_load(struct emitter *e, const struct jit_helpers *h)
+{
+    if (!h->page_mem) {
+        emit_mem(e, h, OP_READ);
+        EMIT(e, 0x41, 0x8b, 0x44, 0x24, offsetof(struct jit_ctx, data));
+        return;
+    }
+
+    EMIT(e, 0x89, 0xc1);                        // mov ecx, eax
+    EMIT(e, 0xc1, 0xe9, DISPATCH_PAGE_BITS);    // shr ecx, DISPATCH_PAGE_BITS
+    EMIT(e, 0x48, 0xba);                        // mov rdx, imm64
+    emit64(e, (uintptr_t)h->page_mem);
+    EMIT(e, 0x48, 0x8b, 0x14, 0xca);            // mov rdx, [rdx + 8 * rcx]
+    EMIT(e, 0x48, 0x85, 0xd2);                  // test rdx, rdx
+    EMIT(e, 0x74, 0);                           // jz slow
+    unsigned char *slow = e->p;
+    EMIT(e, 0x25); emit32(e, DISPATCH_PAGE_MASK);// and eax, DISPATCH_PAGE_MASK
+    EMIT(e, 0x8b, 0x04, 0x82);                  // mov eax, [rdx + 4 * rax]
+    EMIT(e, 0xeb, 0);                           // jmp done
+    unsigned char *done = e->p;
+
+    slow[-1] = e->p - slow;
+    emit_mem(e, h, OP_READ);
+    EMIT(e, 0x41, 0x8b, 0x44, 0x24, offsetof(struct jit_ctx, data));
+    done[-1] = e->p - done;
+}
+
+static void emit_op(struct emitter *e, int op)
+{
+    // eax <- eax op ecx
+    switch (op) {
+        case OP_ADD                 : EMIT(e, 0x01, 0xc8);       break;
+        case OP_SUBTRACT            : EMIT(e, 0x29, 0xc8);       break;
+        case OP_MULTIPLY            : EMIT(e, 0x0f, 0xaf, 0xc1); break;
+        case OP_SHIFT_LEFT          : EMIT(e, 0xd3, 0xe0);       break;
+        case OP_SHIFT_RIGHT_LOGICAL : EMIT(e, 0xd3, 0xe8);       break;
+        case OP_BITWISE_AND         : EMIT(e, 0x21, 0xc8);       break;
+        case OP_BITWISE_ANDN        : EMIT(e, 0xf7, 0xd1, 0x21, 0xc8); break;
+        case OP_BITWISE_OR          : EMIT(e, 0x09, 0xc8);       break;
+        case OP_BITWISE_XOR         : EMIT(e, 0x31, 0xc8);       break;
+        case OP_BITWISE_XORN        : EMIT(e, 0xf7, 0xd1, 0x31, 0xc8); break;
+
+        case OP_COMPARE_LT          :
+        case OP_COMPARE_EQ          :
+        case OP_COMPARE_GT          :
+        case OP_COMPARE_NE          : {
+            unsigned char cc = op == OP_COMPARE_LT ? 0x9c :
+                               op == OP_COMPARE_EQ ? 0x94 :
+                               op == OP_COMPARE_GT ? 0x9f : 0x95;
+            EMIT(e, 0x39, 0xc8);                // cmp eax, ecx
+            EMIT(e, 0x0f, cc, 0xc0);            // setcc al
+            EMIT(e, 0x0f, 0xb6, 0xc0);          // movzx eax, al
+            EMIT(e, 0xf7, 0xd8);                // neg eax
+            break;
+        }
+
+        default:
+            fatal(0, "Reserved opcode reached translator");
+    }
+}
+
+static void emit_insn(struct emitter *e, const struct jit_insn *i,
+        const struct jit_helpers *h)
+{
+    EMIT(e, 0xc7, 0x43, 15 * 4);                // mov [rbx + 60], imm32
+    emit32(e, i->addr + 1);
+
+    emit_get_reg(e, EAX, i->x, i->addr);
+    if (i->p) {
+        emit_imm(e, ECX, i->imm);
+        emit_get_reg(e, EDX, i->y, i->addr);
+    } else {
+        emit_get_reg(e, ECX, i->y, i->addr);
+        emit_imm(e, EDX, i->imm);
+    }
+
+    emit_op(e, i->op);
+    EMIT(e, 0x01, 0xd0);                        // add eax, edx
+
+    switch (i->dd) {
+        case 0:                                 //  Z  <-  rhs
+            emit_set_reg(e, i->z);
+            break;
+        case 1:                                 //  Z  <- [rhs]
+            EMIT(e, 0x25); emit32(e, PTR_MASK);  // and eax, PTR_MASK
+            emit_load(e, h);
+            emit_set_reg(e, i->z);
+            break;
+        case 2:                                 // [Z] <-  rhs
+            EMIT(e, 0x41, 0x89, 0x44, 0x24, offsetof(struct jit_ctx, data));
+            emit_get_reg(e, EAX, i->z, i->addr);
+            EMIT(e, 0x25); emit32(e, PTR_MASK);
+            emit_mem(e, h, OP_WRITE);
+            break;
+        case 3:                                 //  Z  -> [rhs]
+            emit_get_reg(e, ECX, i->z, i->addr);
+            EMIT(e, 0x41, 0x89, 0x4c, 0x24, offsetof(struct jit_ctx, data));
+            EMIT(e, 0x25); emit32(e, PTR_MASK);
+            emit_mem(e, h, OP_WRITE);
+            break;
+    }
+
+    if (h->post) {
+        EMIT(e, 0x4c, 0x89, 0xe7);              // mov rdi, r12
+        EMIT(e, 0xbe);                          // mov esi, imm32
+        emit32(e, i->word);
+        EMIT(e, 0x48, 0xb8);                    // mov rax, imm64
+        emit64(e, (uintptr_t)h->post);
+        EMIT(e, 0xff, 0xd0);                    // call rax
+    }
+
+    if (i->dd >= 2) {
+        // a store may have asked us to stop
+        EMIT(e, 0x41, 0x8b, 0x44, 0x24, offsetof(struct jit_ctx, stop));
+        EMIT(e, 0x85, 0xc0);                    // test eax, eax
+        emit_jnz_exit(e);
+    }
+}
+
+struct jit *jit_init(size_t size)
+{
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                        MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (base == MAP_FAILED) {
+        debug(1, "Could not map %lu bytes for translated code", (unsigned long)size);
+        return NULL;
+    }
+
+    struct jit *j = malloc(sizeof *j);
+    *j = (struct jit){ .base = base, .size = size, .used = 0 };
+
+    return j;
+}
+
+jit_code *jit_compile(struct jit *j, size_t count,
+        const struct jit_insn insns[count], const struct jit_helpers *h)
+{
+    size_t worst = PROLOGUE_BYTES + count * MAX_INSN_BYTES + EPILOGUE_BYTES;
+    if (j->size - j->used < worst || count > JIT_MAX_INSNS)
+        return NULL;
+
+    void *start = j->base + j->used;
+    struct emitter _e = { .p = start, .fixups_count = 0 }, *e = &_e;
+
+    EMIT(e, 0x53);                              // push rbx
+    EMIT(e, 0x41, 0x54);                        // push r12
+    EMIT(e, 0x48, 0x83, 0xec, 0x08);            // sub rsp, 8 (alignment)
+    EMIT(e, 0x49, 0x89, 0xfc);                  // mov r12, rdi
+    EMIT(e, 0x49, 0x8b, 0x5c, 0x24, offsetof(struct jit_ctx, regs));
+
+    for (size_t k = 0; k < count; k++)
+        emit_insn(e, &insns[k], h);
+
+    EMIT(e, 0x31, 0xc0);                        // xor eax, eax
+    e->exit = e->p;
+    EMIT(e, 0x48, 0x83, 0xc4, 0x08);            // add rsp, 8
+    EMIT(e, 0x41, 0x5c);                        // pop r12
+    EMIT(e, 0x5b);                              // pop rbx
+    EMIT(e, 0xc3);                              // ret
+
+    for (size_t k = 0; k < e->fixups_count; k++) {
+        unsigned char *f = e->fixups[k];
+        int32_t rel = e->exit - (f + 4);
+        for (int i = 0; i < 4; i++)
+            f[i] = (uint32_t)rel >> (i * 8);
+    }
+
+    j->used += e->p - (unsigned char *)start;
+    // keep entry points aligned
+    j->used = (j->used + 15) & ~(size_t)15;
+
+    return ALIASING_CAST(jit_code, start);
+}
+
+void jit_reset(struct jit *j)
+{
+    j->used = 0;
+}
+
+void jit_fini(struct jit *j)
+{
+    munmap(j->base, j->size);
+    free(j);
+}
+
+#else
+
+struct jit *jit_init(size_t size)
+{
+    (void)size;
+    debug(1, "No translator exists for this host");
+    return NULL;
+}
+
+jit_code *jit_compile(struct jit *j, size_t count,
+        const struct jit_insn insns[count], const struct jit_helpers *h)
+{
+    (void)j, (void)count, (void)insns, (void)h;
+    return NULL;
+}
+
+void jit_reset(struct jit *j)
+{
+    (void)j;
+}
+
+void jit_fini(struct jit *j)
+{
+    (void)j;
+}
+
+#endif
+
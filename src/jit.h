@@ -0,0 +1,59 @@
+/*
+ * Translates basic blocks of tenyr instructions into native host code. Only
+ * some hosts are supported ; on others, jit_init() returns NULL and callers
+ * are expected to carry on interpreting.
+ */
+
+#ifndef JIT_H_
+#define JIT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// state shared between translated code and the helpers it calls
+struct jit_ctx {
+    int32_t *regs;      ///< the sixteen machine registers
+    uint32_t data;      ///< word to be stored, or word just loaded
+    uint32_t stop;      ///< set nonzero by a helper to leave a block early
+    void *ud;           ///< for use by helpers
+};
+
+/// performs a memory operation on ctx->data ; nonzero return ends the block
+typedef int jit_mem_helper(struct jit_ctx *c, int op, uint32_t addr);
+/// called after each instruction, with its encoding (return value is ignored)
+typedef int jit_post_helper(struct jit_ctx *c, uint32_t word);
+/// returns 0, or the nonzero value from a helper or from ctx->stop
+typedef int jit_code(struct jit_ctx *c);
+
+struct jit_helpers {
+    jit_mem_helper *mem;
+    jit_post_helper *post;  ///< may be NULL
+    /// if not NULL, host storage by dispatch page (NULL entries are not plain
+    /// memory), from which loads are made without calling mem
+    const uint32_t * const *page_mem;
+};
+
+/// a general-type instruction with a valid (not reserved) operation
+struct jit_insn {
+    uint32_t addr;
+    uint32_t word;      ///< encoding, for jit_helpers.post
+    int32_t imm;        ///< sign-extended immediate
+    uint8_t op, x, y, z, dd, p;
+};
+
+/// the longest block jit_compile() accepts
+#define JIT_MAX_INSNS 64
+
+struct jit;
+
+/// returns NULL if this host cannot run translated code
+struct jit *jit_init(size_t size);
+/// returns NULL if there is no room left for the translated code
+jit_code *jit_compile(struct jit *j, size_t count,
+        const struct jit_insn insns[count], const struct jit_helpers *h);
+/// discards all translated code
+void jit_reset(struct jit *j);
+void jit_fini(struct jit *j);
+
+#endif
+
@@ -3,10 +3,75 @@
 
 #include <stdint.h>
 
+// Memory dispatch is looked up per page of 1K words (matching the pages kept by
+// the sparse RAM device), rather than searching the devices on every access.
+#define DISPATCH_PAGE_BITS  10
+#define DISPATCH_PAGE_WORDS (1u << DISPATCH_PAGE_BITS)
+#define DISPATCH_PAGE_MASK  (DISPATCH_PAGE_WORDS - 1)
+#define DISPATCH_PAGES      ((PTR_MASK >> DISPATCH_PAGE_BITS) + 1)
+
+// Events counted as instructions run (instructions themselves are counted by
+// machine_state.cycles)
+#define COUNTERS(_) \
+    _(loads     , "loads from memory") \
+    _(stores    , "stores to memory") \
+    _(transfers , "control transfers taken") \
+    _(traps     , "illegal instructions reached") \
+    _(interrupts, "interrupts taken") \
+    _(waited    , "cycles waiting for interrupts") \
+    _(skipped   , "cycles skipped in idle loops") \
+    //
+
+struct counters {
+#define COUNTER_FIELD(Name,Desc) uint64_t Name;
+    COUNTERS(COUNTER_FIELD)
+#undef COUNTER_FIELD
+};
+
+// Devices raise interrupt lines by setting bits in pending. When a line that
+// is enabled is pending and interrupts are enabled, the simulator saves P in
+// saved, disables interrupts, and continues at vector. The interrupt
+// controller device makes these visible to programs.
+struct irq_state {
+    uint32_t pending;       ///< lines raised and not yet cleared
+    uint32_t enabled;       ///< lines that may interrupt
+    uint32_t vector;        ///< address of the handler
+    uint32_t saved;         ///< value of P when the handler was entered
+    uint32_t ie;            ///< whether interrupts are enabled
+    uint32_t waiting;       ///< whether the processor waits for an interrupt
+    /// P just after ie was set ; the first check for interrupts that finds P
+    /// there takes none, so that the instruction there can return from a handler
+    uint32_t shadow;
+    uint32_t shadowed;      ///< whether shadow has yet to be checked
+    int ready;              ///< whether the simulator must check for interrupts
+};
+
+// keeps irq->ready up to date, after any change to irq
+static inline void irq_update(struct irq_state *irq)
+{
+    irq->ready = irq->waiting || (irq->ie && (irq->pending & irq->enabled));
+}
+
 struct machine_state {
     size_t devices_count;   ///< how many device slots are used
     size_t devices_max;     ///< how many device slots are allocated
     struct device **devices;
+    /// by dispatch page : the only device in that page, or NULL
+    struct device **page_device;
+    /// by dispatch page : host storage for the page, if it is plain memory
+    uint32_t **page_mem;
+    /// by dispatch page : host storage that may be read, which is page_mem if
+    /// that is not NULL, but may otherwise be shared between pages
+    const uint32_t **page_read;
+    /// how many instructions have been run, and cycles spent waiting for an
+    /// interrupt
+    uint64_t cycles;
+    uint64_t next_event;    ///< value of cycles at which a device is next due
+    struct counters counters;
+    struct irq_state irq;
+    /// set by a load from a device whose contents may change other than at
+    /// its deadlines, so that a loop reading it may be making progress
+    int volatile_loads;
     int32_t regs[16];
 } machine;
 
@@ -1,10 +1,17 @@
-// TODO make an mmap()-based version of this for systems that support it
+// for fileno()
+#define _XOPEN_SOURCE 600
 
 #include "obj.h"
 
 #include <stdlib.h>
 #include <string.h>
 
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define OBJ_MMAP 1
+#endif
+
 #define MAGIC_BYTES "TOV"
 
 #define PUT(What,Where) put_sized(&(What), sizeof (What), Where)
@@ -67,41 +74,104 @@ int obj_write(struct obj *o, FILE *out)
     }
 }
 
+// Objects are read from a stream, or else from a mapping of the file, so that
+// record data can be used in place.
+struct source {
+    FILE *in;
+    const unsigned char *p;     ///< next byte of the mapping, or NULL
+    const unsigned char *end;
+};
+
+#define TAKE(What,Where) take_sized(&(What), sizeof (What), Where)
+
+static void take_sized(void *what, size_t size, struct source *src)
+{
+    if (!src->p) {
+        get_sized(what, size, src->in);
+    } else if ((size_t)(src->end - src->p) >= size) {
+        memcpy(what, src->p, size);
+        src->p += size;
+    } else {
+        fatal(0, "Unexpected end of object in %s while parsing object", __func__);
+    }
+}
+
+static UWord *take_data(UWord size, struct source *src)
+{
+    if (!src->p) {
+        UWord *data = calloc(size, sizeof *data);
+        if (fread(data, sizeof *data, size, src->in) != size)
+            fatal(PRINT_ERRNO, "Unknown error occurred while parsing object");
+        return data;
+    }
+
+    if ((size_t)(src->end - src->p) / sizeof(UWord) < size)
+        fatal(0, "Unexpected end of object in %s while parsing object", __func__);
+    // the mapping starts on a page, and the source on a word, so this is aligned
+    UWord *data = (UWord*)src->p;
+    src->p += size * sizeof *data;
+    return data;
+}
+
+#if OBJ_MMAP
+// Maps a regular file privately, so that record data may be written (as tld
+// does when relocating) without affecting the file. Returns nonzero if the
+// stream cannot be mapped, having consumed nothing from it.
+static int obj_map(struct obj *o, struct source *src)
+{
+    struct stat st;
+    long start = ftell(src->in);
+    int fd = fileno(src->in);
+    if (start < 0 || start % sizeof(UWord) || fstat(fd, &st) ||
+            !S_ISREG(st.st_mode) || st.st_size <= start)
+        return 1;
+
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return 1;
+
+    o->map = map;
+    o->map_size = st.st_size;
+    src->p = (const unsigned char *)map + start;
+    src->end = (const unsigned char *)map + st.st_size;
+
+    return 0;
+}
+#endif
+
 #define for_counted_get(Tag,Name,List,Count) \
     for (struct Tag *_f = NULL, *_l = NULL, *Name = NULL; \
             ((Count) ? Name ? !!(Count) : !!(Name = List = calloc(Count, sizeof *Name)) : 0) && !_f; \
             _f++) \
         for (UWord _i = (Count); _i > 0; _l ? (void)(_l->next = Name) : (void)0, _l = Name++, _i--)
 
-static int obj_v0_read(struct obj *o, FILE *in)
+static int obj_v0_read(struct obj *o, struct source *in)
 {
-    GET(o->flags, in);
+    TAKE(o->flags, in);
 
-    GET(o->rec_count, in);
+    TAKE(o->rec_count, in);
     o->bloc.records = 1;
     for_counted_get(objrec, rec, o->records, o->rec_count) {
-        GET(rec->addr, in);
-        GET(rec->size, in);
-        rec->data = calloc(rec->size, sizeof *rec->data);
-        if (fread(rec->data, sizeof *rec->data, rec->size, in) != rec->size)
-            fatal(PRINT_ERRNO, "Unknown error occurred while parsing object");
+        TAKE(rec->addr, in);
+        TAKE(rec->size, in);
+        rec->data = take_data(rec->size, in);
     }
 
-    GET(o->sym_count, in);
+    TAKE(o->sym_count, in);
     o->bloc.symbols = 1;
     for_counted_get(objsym, sym, o->symbols, o->sym_count) {
-        GET(sym->flags, in);
-        GET(sym->name, in);
-        GET(sym->value, in);
+        TAKE(sym->flags, in);
+        TAKE(sym->name, in);
+        TAKE(sym->value, in);
     }
 
-    GET(o->rlc_count, in);
+    TAKE(o->rlc_count, in);
     o->bloc.relocs = 1;
     for_counted_get(objrlc, rlc, o->relocs, o->rlc_count) {
-        GET(rlc->flags, in);
-        GET(rlc->name, in);
-        GET(rlc->addr, in);
-        GET(rlc->width, in);
+        TAKE(rlc->flags, in);
+        TAKE(rlc->name, in);
+        TAKE(rlc->addr, in);
+        TAKE(rlc->width, in);
     }
 
     return 0;
@@ -109,25 +179,40 @@ static int obj_v0_read(struct obj *o, FILE *in)
 
 int obj_read(struct obj *o, FILE *in)
 {
-    GET(o->magic.parsed.TOV, in);
+    struct source src = { .in = in };
+#if OBJ_MMAP
+    obj_map(o, &src);
+    const unsigned char *start = src.p;
+#endif
+
+    TAKE(o->magic.parsed.TOV, &src);
 
     if (memcmp(o->magic.parsed.TOV, MAGIC_BYTES, sizeof o->magic.parsed.TOV))
         fatal(0, "Bad magic when loading object");
 
-    GET(o->magic.parsed.version, in);
+    TAKE(o->magic.parsed.version, &src);
 
+    int rc = 0;
     switch (o->magic.parsed.version) {
-        case 0: return obj_v0_read(o, in);
+        case 0: rc = obj_v0_read(o, &src); break;
         default:
             fatal(0, "Unhandled version number when loading object");
     }
+
+#if OBJ_MMAP
+    // leave the stream after the object, as if it had been read
+    if (start)
+        fseek(in, src.p - start, SEEK_CUR);
+#endif
+
+    return rc;
 }
 
 static void obj_v0_free(struct obj *o)
 {
     UWord remaining = o->rec_count;
     list_foreach(objrec, rec, o->records) {
-        if (remaining-- <= 0) break;
+        if (o->map || remaining-- <= 0) break;
         free(rec->data);
     }
 
@@ -140,6 +225,10 @@ static void obj_v0_free(struct obj *o)
     if (o->bloc.records) free(o->records);
     else list_foreach(objrec,rec,o->records) free(rec);
 
+#if OBJ_MMAP
+    if (o->map) munmap(o->map, o->map_size);
+#endif
+
     free(o);
 }
 
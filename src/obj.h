@@ -30,6 +30,10 @@ struct obj {
         unsigned relocs:1;
     } bloc;
 
+    /// if not NULL, the file mapping into which record data points
+    void *map;
+    size_t map_size;
+
     UWord rec_count;    ///< count of records, minimum 0
     struct objrec {
         struct objrec *next;
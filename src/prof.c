@@ -0,0 +1,212 @@
+#include "prof.h"
+#include "sim.h"
+#include "common.h"
+
+#include <search.h>
+#include <stdlib.h>
+#include <string.h>
+
+// how deep a call stack is followed
+#define PROF_DEPTH      64
+// how far up the stack return addresses are looked for
+#define PROF_SCAN_WORDS 4096
+
+// The call() macro in lib/common.th stores its return address with
+// `[o] <- p + 2`, which encodes the same whether its immediate is in the
+// type-0 or the type-1 position, so only the p bit is ignored. A word on the
+// stack is taken to be a return address if the word three before the address
+// it names is this instruction.
+#define CALL_SAVE_WORD  0x2ef02002
+#define CALL_SAVE_MASK  0xbfffffff
+
+struct prof {
+    uint64_t period;
+    uint64_t next;      ///< cycle at which the next sample is due
+    unsigned long samples;
+
+    void *flat;         ///< samples by innermost symbol
+    void *folded;       ///< samples by call stack
+    size_t count[2];    ///< number of entries in flat and in folded
+    void *userdata;     ///< transient userdata, used for twalk() support
+};
+
+struct prof_entry {
+    struct prof *state; ///< twalk() support
+    unsigned long count;
+    const char *key;
+    char space[];
+};
+
+static int entry_compare(const void *_a, const void *_b)
+{
+    const struct prof_entry *a = _a;
+    const struct prof_entry *b = _b;
+    return strcmp(a->key, b->key);
+}
+
+static int entry_compare_count(const void *_a, const void *_b)
+{
+    const struct prof_entry * const *a = _a;
+    const struct prof_entry * const *b = _b;
+    if ((*a)->count != (*b)->count)
+        return ((*a)->count < (*b)->count) - ((*a)->count > (*b)->count);
+    return strcmp((*a)->key, (*b)->key);
+}
+
+struct prof *prof_init(struct sim_state *s, uint64_t period)
+{
+    struct prof *p = calloc(1, sizeof *p);
+    p->period = period ? period : 1;
+    p->next = s->machine.cycles + p->period;
+    return p;
+}
+
+// reads memory directly, so that sampling has no effect on devices or counters
+static int peek(struct sim_state *s, uint32_t addr, uint32_t *word)
+{
+    addr &= PTR_MASK;
+    const uint32_t *mem = s->machine.page_read[addr >> DISPATCH_PAGE_BITS];
+    if (!mem)
+        return 0;
+
+    *word = mem[addr & DISPATCH_PAGE_MASK];
+    return 1;
+}
+
+static int is_return_address(struct sim_state *s, uint32_t word)
+{
+    uint32_t insn;
+    return !(word & ~PTR_MASK) && word >= 3 &&
+        peek(s, word - 3, &insn) && (insn & CALL_SAVE_MASK) == CALL_SAVE_WORD;
+}
+
+// names the symbol at or most closely before addr, or else addr itself
+static void symbolise(struct sim_state *s, uint32_t addr, size_t len,
+        char buf[len])
+{
+    size_t lo = 0, hi = s->symbols_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (s->symbols[mid].addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo > 0)
+        snprintf(buf, len, "%s", s->symbols[lo - 1].name);
+    else
+        snprintf(buf, len, "0x%06x", addr);
+}
+
+static void tally(struct prof *p, void **tree, size_t *count, const char *key)
+{
+    struct prof_entry find = { .key = key };
+    struct prof_entry **found = tfind(&find, tree, entry_compare);
+    if (!found) {
+        size_t len = strlen(key) + 1;
+        struct prof_entry *e = malloc(sizeof *e + len);
+        *e = (struct prof_entry){ .state = p, .key = e->space };
+        memcpy(e->space, key, len);
+        found = tsearch(e, tree, entry_compare);
+        ++*count;
+    }
+
+    (*found)->count++;
+}
+
+static void sample(struct prof *p, struct sim_state *s)
+{
+    uint32_t frames[PROF_DEPTH];
+    size_t depth = 0;
+
+    frames[depth++] = s->machine.regs[15] & PTR_MASK;
+    uint32_t sp = s->machine.regs[14] + 1;
+    for (unsigned i = 0; i < PROF_SCAN_WORDS && depth < PROF_DEPTH; i++) {
+        uint32_t word;
+        if (!peek(s, sp + i, &word))
+            break;
+        if (is_return_address(s, word))
+            frames[depth++] = word - 3;
+    }
+
+    char key[PROF_DEPTH * (SYMBOL_LEN + 1)];
+    size_t pos = 0;
+    for (size_t i = depth; i-- > 0; ) {
+        symbolise(s, frames[i], SYMBOL_LEN, &key[pos]);
+        pos += strlen(&key[pos]);
+        if (i > 0)
+            key[pos++] = ';';
+    }
+
+    char inner[SYMBOL_LEN];
+    symbolise(s, frames[0], sizeof inner, inner);
+    tally(p, &p->flat, &p->count[0], inner);
+    tally(p, &p->folded, &p->count[1], key);
+    p->samples++;
+}
+
+uint64_t prof_event(struct prof *p, struct sim_state *s)
+{
+    if (s->machine.cycles >= p->next) {
+        sample(p, s);
+        p->next = s->machine.cycles + p->period;
+    }
+
+    return p->next;
+}
+
+static struct prof_entry **collected;
+static size_t collected_count;
+
+static void collect(const void *node, VISIT order, int level)
+{
+    (void)level;
+    if (order == leaf || order == postorder)
+        collected[collected_count++] = *(struct prof_entry * const *)node;
+}
+
+// returns the entries of tree, most samples first
+static struct prof_entry **sorted(void *tree, size_t count)
+{
+    collected = malloc((count ? count : 1) * sizeof *collected);
+    collected_count = 0;
+    twalk(tree, collect);
+    qsort(collected, collected_count, sizeof *collected, entry_compare_count);
+    return collected;
+}
+
+int prof_write(struct prof *p, FILE *flat, FILE *folded)
+{
+    if (flat) {
+        struct prof_entry **e = sorted(p->flat, p->count[0]);
+        fprintf(flat, "%10s %7s  %s\n", "samples", "percent", "symbol");
+        for (size_t i = 0; i < p->count[0]; i++)
+            fprintf(flat, "%10lu %6.2f%%  %s\n", e[i]->count,
+                    100. * e[i]->count / p->samples, e[i]->key);
+        fprintf(flat, "%10lu %6.2f%%  %s\n", p->samples, 100., "(total)");
+        free(e);
+    }
+
+    if (folded) {
+        struct prof_entry **e = sorted(p->folded, p->count[1]);
+        for (size_t i = 0; i < p->count[1]; i++)
+            fprintf(folded, "%s %lu\n", e[i]->key, e[i]->count);
+        free(e);
+    }
+
+    return 0;
+}
+
+TODO_TRAVERSE_(prof_entry)
+
+void prof_fini(struct prof *p)
+{
+    struct todo_node *todo = NULL;
+    p->userdata = &todo;
+
+    tree_destroy(&todo, &p->flat, traverse_prof_entry, entry_compare);
+    tree_destroy(&todo, &p->folded, traverse_prof_entry, entry_compare);
+    free(p);
+}
+
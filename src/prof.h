@@ -0,0 +1,27 @@
+/*
+ * Samples the program counter every so many retired instructions, and writes
+ * the samples out by symbol, both flat and as collapsed call stacks (one line
+ * per distinct stack, outermost frame first, as read by flame-graph tools).
+ */
+
+#ifndef PROF_H_
+#define PROF_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct sim_state;
+struct prof;
+
+/// the default number of instructions retired between samples
+#define PROF_PERIOD 1000
+
+struct prof *prof_init(struct sim_state *s, uint64_t period);
+/// takes a sample if one is due, and returns the cycle at which the next is due
+uint64_t prof_event(struct prof *p, struct sim_state *s);
+/// either of flat or folded may be NULL
+int prof_write(struct prof *p, FILE *flat, FILE *folded);
+void prof_fini(struct prof *p);
+
+#endif
+
@@ -1,45 +1,120 @@
 #include "sim.h"
+#include "jit.h"
+#include "undo.h"
 #include "common.h"
 
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 
-static void do_op(enum op op, int type, int32_t *rhs, uint32_t X, uint32_t Y,
-        uint32_t I)
-{
-    int32_t  Xs = X;
-    uint32_t Xu = X;
-    int32_t  Ys = Y;
-    int32_t  Is = SEXTEND(12, I);
+// Predecoded instructions are kept in a direct-mapped cache indexed by the low
+// bits of their address, so that run_sim() need neither fetch nor decode an
+// instruction it has already seen. A write to memory evicts the entry for the
+// address written (see note_write()).
+#define ICACHE_BITS     16
+#define ICACHE_SIZE     (1 << ICACHE_BITS)
+#define ICACHE_EMPTY    ((uint32_t)-1)
 
-    int32_t  O = (type == 0) ? Ys : Is;
-    int32_t  A = (type == 0) ? Is : Ys;
+// X is the first operand ; O and A are the second operand and the addend,
+// already ordered according to the instruction type
+#define OPS(_) \
+    _(ADD                 ,  (Xs  +  O)) \
+    _(SUBTRACT            ,  (Xs  -  O)) \
+    _(MULTIPLY            ,  (Xs  *  O)) \
+    \
+    _(SHIFT_LEFT          ,  (Xu  << O)) \
+    _(SHIFT_RIGHT_LOGICAL ,  (Xu  >> O)) \
+    \
+    _(COMPARE_LT          , -(Xs  <  O)) \
+    _(COMPARE_EQ          , -(Xs  == O)) \
+    _(COMPARE_GT          , -(Xs  >  O)) \
+    _(COMPARE_NE          , -(Xs  != O)) \
+    \
+    _(BITWISE_AND         ,  (Xu  &  O)) \
+    _(BITWISE_ANDN        ,  (Xu  & ~O)) \
+    _(BITWISE_OR          ,  (Xu  |  O)) \
+    _(BITWISE_XOR         ,  (Xu  ^  O)) \
+    _(BITWISE_XORN        ,  (Xu  ^ ~O)) \
+    //
 
-    switch (op) {
-        case OP_ADD                 : *rhs =  (Xs  +  O) + A; break;
-        case OP_SUBTRACT            : *rhs =  (Xs  -  O) + A; break;
-        case OP_MULTIPLY            : *rhs =  (Xs  *  O) + A; break;
+struct decoded;
+typedef int insn_handler(struct sim_state *s, const struct decoded *d);
 
-        case OP_SHIFT_LEFT          : *rhs =  (Xu  << O) + A; break;
-        case OP_SHIFT_RIGHT_LOGICAL : *rhs =  (Xu  >> O) + A; break;
+struct decoded {
+    uint32_t addr;      ///< address this entry was decoded from
+    uint32_t word;      ///< raw instruction, for run_ops hooks
+    insn_handler *run;  ///< executes this instruction
+    int32_t imm;        ///< sign-extended immediate
+    uint8_t x, y, z, dd, p;
+};
 
-        case OP_COMPARE_LT          : *rhs = -(Xs  <  O) + A; break;
-        case OP_COMPARE_EQ          : *rhs = -(Xs  == O) + A; break;
-        case OP_COMPARE_GT          : *rhs = -(Xs  >  O) + A; break;
-        case OP_COMPARE_NE          : *rhs = -(Xs  != O) + A; break;
+struct icache {
+    struct decoded entries[ICACHE_SIZE];
+};
 
-        case OP_BITWISE_AND         : *rhs =  (Xu  &  O) + A; break;
-        case OP_BITWISE_ANDN        : *rhs =  (Xu  & ~O) + A; break;
-        case OP_BITWISE_OR          : *rhs =  (Xu  |  O) + A; break;
-        case OP_BITWISE_XOR         : *rhs =  (Xu  ^  O) + A; break;
-        case OP_BITWISE_XORN        : *rhs =  (Xu  ^ ~O) + A; break;
+// Basic blocks for run_blocks() are straight-line runs of decoded
+// instructions, each ending with the first instruction that writes P (or with
+// an illegal instruction, or after BLOCK_MAX_LEN instructions). Blocks are
+// found by entry address through a hash table, and each remembers the blocks
+// that most recently followed it so that most control transfers need no
+// lookup at all. Any write to a word covered by a block flushes every block.
+// When the jit recipe is in effect, a block run more than jit.threshold times
+// is translated to native code.
+#define BLOCK_MAX_LEN       JIT_MAX_INSNS
+#define BLOCK_HASH_BITS     14
+#define BLOCK_HASH_SIZE     (1 << BLOCK_HASH_BITS)
+#define BLOCK_MAX_COUNT     (1 << 16)   ///< flush all blocks beyond this many
+#define JIT_CODE_SIZE       (16 << 20)  ///< bytes of translated code
+#define JIT_THRESHOLD       100         ///< default for jit.threshold
+#define JIT_STOP            2           ///< jit_ctx.stop value for a flush
 
-        default:
-            fatal(0, "Encountered reserved opcode");
-    }
+struct block {
+    struct block *next;         ///< next block in the same hash bucket
+    struct block *succ[2];      ///< most recent successors, newest first
+    uint32_t addr;              ///< entry address
+    uint32_t len;               ///< count of instructions
+    uint32_t loads, stores;     ///< memory operations made by the whole block
+    unsigned long hits;         ///< how many times this block has started
+    jit_code *native;           ///< translation, if any
+    struct decoded insns[];
+};
+
+struct block_cache {
+    struct block *buckets[BLOCK_HASH_SIZE];
+    unsigned long count;
+    int flush_pending;          ///< set when a block has been written over
+    uint32_t lo, hi;            ///< bounds of the addresses covered by blocks
+    unsigned char code[(PTR_MASK + 1) / CHAR_BIT]; ///< words covered by blocks
+
+    struct jit *jit;            ///< NULL unless translating
+    unsigned long jit_threshold;
+    int jit_check;              ///< whether to check translations as they run
+    struct jit_ctx ctx;
+    struct jit_access {
+        int op;
+        uint32_t addr;
+        uint32_t data;
+    } log[BLOCK_MAX_LEN];       ///< memory accesses made by a translation
+    size_t log_count;
+};
+
+// keeps cached instructions coherent with a write to memory at addr
+static void note_write(struct sim_state *s, uint32_t addr)
+{
+    if (s->icache)
+        s->icache->entries[addr & (ICACHE_SIZE - 1)].addr = ICACHE_EMPTY;
+    if (s->blocks && s->blocks->code[addr / CHAR_BIT] & (1 << (addr % CHAR_BIT)))
+        s->blocks->flush_pending = 1;
+}
+
+void sim_note_write(struct sim_state *s, uint32_t addr, uint32_t count)
+{
+    for (uint32_t k = 0; k < count; k++)
+        note_write(s, (addr + k) & PTR_MASK);
 }
 
-static int do_common(struct sim_state *s, int32_t *ip, int32_t *Z, int32_t
+static inline int do_common(struct sim_state *s, int32_t *ip, int32_t *Z, int32_t
         *rhs, uint32_t *value, int deref_lhs, int deref_rhs, int reversed)
 {
     uint32_t r_addr = (reversed ? *Z        : *rhs     ) & PTR_MASK;
@@ -51,15 +126,26 @@ static int do_common(struct sim_state *s, int32_t *ip, int32_t *Z, int32_t
     int32_t *r      =  reversed ? Z         : rhs;
     int32_t *w      =  reversed ? rhs       : Z;
 
-    if (read_mem)
-        s->dispatch_op(s, OP_READ, r_addr, value);
-    else
+    if (read_mem) {
+        s->dispatch_op(s, OP_READ | OP_DATA, r_addr, value);
+        s->machine.counters.loads++;
+    } else
         *value = *r;
 
-    if (write_mem)
-        s->dispatch_op(s, OP_WRITE, w_addr, value);
-    else if (w != &s->machine.regs[0])  // throw away write to reg 0
+    // w points into regs only if memory is not written
+    if (s->undo)
+        undo_note(s, write_mem, w_addr,
+                write_mem ? 0 : (int)(w - s->machine.regs));
+
+    if (write_mem) {
+        s->dispatch_op(s, OP_WRITE | OP_DATA, w_addr, value);
+        s->machine.counters.stores++;
+        note_write(s, w_addr);
+    } else if (w != &s->machine.regs[0]) { // throw away write to reg 0
+        if (w == ip && (int32_t)*value != *ip)
+            s->machine.counters.transfers++;
         *w = *value;
+    }
 
     if (w != ip) {
         if (*ip & ~PTR_MASK && s->conf.nowrap) {
@@ -76,75 +162,698 @@ static int do_common(struct sim_state *s, int32_t *ip, int32_t *Z, int32_t
     return 0;
 }
 
+// The handlers for general-type instructions are specialised for each
+// combination of operation, type (p) and dereference (dd), so that executing
+// an instruction makes no decisions that could have been made when it was
+// decoded. do_common() is inlined into each, with its flags constant.
+#define RUN_HANDLER(Name,Expr,P,DD)                                            \
+    static int run_##Name##_##P##DD(struct sim_state *s, const struct decoded *d) \
+    {                                                                          \
+        int32_t *regs = s->machine.regs;                                       \
+        int32_t *ip = &regs[15];                                               \
+        assert(("PC within address space", !(*ip & ~PTR_MASK)));              \
+                                                                               \
+        ++*ip;                                                                 \
+                                                                               \
+        int32_t  Xs = regs[d->x];                                              \
+        uint32_t Xu = Xs;                                                      \
+        int32_t  O  = (P) ? d->imm : regs[d->y];                               \
+        int32_t  A  = (P) ? regs[d->y] : d->imm;                               \
+        (void)Xu;                                                              \
+                                                                               \
+        int32_t rhs = Expr + A;                                                \
+        uint32_t value;                                                        \
+        return do_common(s, ip, &regs[d->z], &rhs, &value,                     \
+                (DD) == 2, (DD) & 1, (DD) == 3);                               \
+    }                                                                          \
+    //
+
+#define RUN_HANDLERS(Name,Expr) \
+    RUN_HANDLER(Name,Expr,0,0) \
+    RUN_HANDLER(Name,Expr,0,1) \
+    RUN_HANDLER(Name,Expr,0,2) \
+    RUN_HANDLER(Name,Expr,0,3) \
+    RUN_HANDLER(Name,Expr,1,0) \
+    RUN_HANDLER(Name,Expr,1,1) \
+    RUN_HANDLER(Name,Expr,1,2) \
+    RUN_HANDLER(Name,Expr,1,3) \
+    //
+
+OPS(RUN_HANDLERS)
+
+static int run_illegal(struct sim_state *s, const struct decoded *d)
+{
+    (void)d;
+    ++s->machine.regs[15];
+    s->machine.counters.traps++;
+
+    if (s->conf.abort)
+        abort();
+    else
+        return 1;
+}
+
+static int run_reserved(struct sim_state *s, const struct decoded *d)
+{
+    (void)s, (void)d;
+    fatal(0, "Encountered reserved opcode");
+}
+
+// indexed by the top four bits of a general-type instruction (p and dd), and
+// then by its operation
+static insn_handler * const run_handlers[8][16] = {
+    #define RUN_ENTRIES(Name,Expr)                                             \
+        [0][OP_##Name] = run_##Name##_00, [1][OP_##Name] = run_##Name##_01,    \
+        [2][OP_##Name] = run_##Name##_02, [3][OP_##Name] = run_##Name##_03,    \
+        [4][OP_##Name] = run_##Name##_10, [5][OP_##Name] = run_##Name##_11,    \
+        [6][OP_##Name] = run_##Name##_12, [7][OP_##Name] = run_##Name##_13,    \
+        //
+    OPS(RUN_ENTRIES)
+};
+
+static void decode(struct decoded *d, uint32_t addr, uint32_t word)
+{
+    struct instruction i = { .u.word = word };
+    struct instruction_general *g = &i.u._0xxx;
+
+    insn_handler *run = run_illegal;
+    if (!g->t && !(run = run_handlers[word >> 28][g->op]))
+        run = run_reserved;
+
+    *d = (struct decoded){
+        .addr = addr,
+        .word = word,
+        .run  = run,
+        .imm  = SEXTEND(12, g->imm),
+        .x    = g->x,
+        .y    = g->y,
+        .z    = g->z,
+        .dd   = g->dd,
+        .p    = g->p,
+    };
+}
+
 int run_instruction(struct sim_state *s, struct instruction *i)
 {
-    int32_t *ip = &s->machine.regs[15];
-    assert(("PC within address space", !(*ip & ~PTR_MASK)));
-
-    ++*ip;
-
-    switch (i->u._xxxx.t) {
-        case 0x0:
-        case 0x1:
-        case 0x2:
-        case 0x3:
-        case 0x4:
-        case 0x5:
-        case 0x6:
-        case 0x7: {
-            struct instruction_general *g = &i->u._0xxx;
-            int32_t rhs = 0;
-            uint32_t value;
-
-            do_op(g->op, g->p, &rhs, s->machine.regs[g->x],
-                                     s->machine.regs[g->y],
-                                     g->imm);
-            do_common(s, ip, &s->machine.regs[g->z], &rhs, &value, g->dd == 2,
-                    g->dd & 1, g->dd == 3);
+    assert(("PC within address space", !(s->machine.regs[15] & ~PTR_MASK)));
 
-            break;
+    struct decoded d;
+    decode(&d, s->machine.regs[15], i->u.word);
+    if (d.run(s, &d))
+        return 1;
+
+    s->machine.cycles++;
+    return 0;
+}
+
+// counts instructions just run, and lets any device that is now due act
+static inline void retire(struct sim_state *s, struct run_ops *ops,
+        uint32_t count)
+{
+    s->machine.cycles += count;
+    if (s->machine.cycles >= s->machine.next_event && ops->event)
+        ops->event(s);
+}
+
+// lets time pass straight to the next device event, adding the cycles passed
+// to *counter ; returns nonzero if no event is due
+static int skip_to_event(struct sim_state *s, struct run_ops *ops,
+        uint64_t *counter)
+{
+    uint64_t next = s->machine.next_event;
+    if (next == UINT64_MAX || !ops->event)
+        return 1;
+
+    if (next > s->machine.cycles) {
+        *counter += next - s->machine.cycles;
+        s->machine.cycles = next;
+    }
+    ops->event(s);
+
+    return 0;
+}
+
+// how many backward transfers pass between checks for an idle loop
+#define SPIN_INTERVAL 256
+
+// the machine state after a backward transfer, to be compared with that after
+// the next one
+struct spin {
+    uint32_t countdown;         ///< backward transfers until the next check
+    int armed;                  ///< whether stores and regs have been taken
+    uint64_t stores;            ///< value of counters.stores
+    int32_t regs[16];
+};
+
+// Called after a backward transfer when spin->countdown runs out. If the
+// program is where it was after the last one, with the same registers, having
+// stored nothing and loaded nothing that could change before the next device
+// event, and no interrupt is due, it cannot progress until then, and time
+// passes straight to it. Returns nonzero if no event is due, and so the
+// program can never progress.
+static int spin_check(struct sim_state *s, struct run_ops *ops, struct spin *sp)
+{
+    struct machine_state *m = &s->machine;
+    int same = sp->armed && m->counters.stores == sp->stores &&
+        !m->volatile_loads && !m->irq.ready &&
+        !memcmp(m->regs, sp->regs, sizeof sp->regs);
+
+    if (!same) {
+        // compare with the state after the next backward transfer, unless
+        // this was that comparison
+        sp->armed = !sp->armed;
+        sp->countdown = sp->armed ? 1 : SPIN_INTERVAL;
+        sp->stores = m->counters.stores;
+        memcpy(sp->regs, m->regs, sizeof sp->regs);
+        m->volatile_loads = 0;
+        return 0;
+    }
+
+    sp->countdown = 1;
+    if (skip_to_event(s, ops, &m->counters.skipped)) {
+        fprintf(stderr, "Stopped at %#x in a loop that makes no progress\n",
+                m->regs[15]);
+        return 1;
+    }
+
+    return 0;
+}
+
+// Waits, if the program asked to, until an enabled interrupt line is pending,
+// letting time pass straight to each device event ; then enters the handler
+// if interrupts are enabled. Returns nonzero if the wait could never end.
+static int interrupt(struct sim_state *s, struct run_ops *ops)
+{
+    struct irq_state *irq = &s->machine.irq;
+
+    while (irq->waiting && !(irq->pending & irq->enabled)) {
+        if (skip_to_event(s, ops, &s->machine.counters.waited)) {
+            fprintf(stderr, "Waiting at %#x for an interrupt that cannot come\n",
+                    s->machine.regs[15]);
+            return 1;
         }
-        default:
-            if (s->conf.abort)
-                abort();
-            else
-                return 1;
     }
 
+    irq->waiting = 0;
+    uint32_t pc = s->machine.regs[15];
+    int shadowed = irq->shadowed && pc == irq->shadow;
+    irq->shadowed = 0;
+    if (irq->ie && (irq->pending & irq->enabled) && !shadowed) {
+        irq->saved = pc;
+        irq->ie = 0;
+        s->machine.regs[15] = irq->vector & PTR_MASK;
+        s->machine.counters.interrupts++;
+    }
+
+    irq_update(irq);
+
+    return 0;
+}
+
+int run_events(struct sim_state *s, struct run_ops *ops)
+{
+    if (s->machine.cycles >= s->machine.next_event && ops->event)
+        ops->event(s);
+
+    if (s->machine.irq.ready && interrupt(s, ops))
+        return 1;
+
     return 0;
 }
 
 int run_sim(struct sim_state *s, struct run_ops *ops)
 {
+    int rc = 0;
+    struct spin spin = { .countdown = SPIN_INTERVAL };
+    struct icache *c = s->icache = malloc(sizeof *c);
+    for (unsigned long j = 0; j < countof(c->entries); j++)
+        c->entries[j].addr = ICACHE_EMPTY;
+
     while (1) {
-        assert(("PC within address space", !(s->machine.regs[15] & ~PTR_MASK)));
+        uint32_t pc = s->machine.regs[15];
+        assert(("PC within address space", !(pc & ~PTR_MASK)));
+        struct decoded *d = &c->entries[pc & (ICACHE_SIZE - 1)];
+        if (d->addr != pc) {
+            uint32_t word;
+            if (s->dispatch_op(s, OP_READ, pc, &word)) {
+                rc = 1;
+                break;
+            }
+            decode(d, pc, word);
+        }
+
+        struct instruction i;
+        i.u.word = d->word;
+
+        if (ops->pre_insn)
+            ops->pre_insn(s, &i);
+
+        if (d->run(s, d)) {
+            rc = 1;
+            break;
+        }
+
+        if (ops->post_insn)
+            ops->post_insn(s, &i);
+
+        retire(s, ops, 1);
+
+        if ((uint32_t)s->machine.regs[15] <= pc && !--spin.countdown &&
+                spin_check(s, ops, &spin)) {
+            rc = 1;
+            break;
+        }
+
+        if (s->machine.irq.ready && interrupt(s, ops)) {
+            rc = 1;
+            break;
+        }
+    }
+
+    free(c);
+    s->icache = NULL;
+
+    return rc;
+}
+
+static inline unsigned block_hash(uint32_t addr)
+{
+    return (addr ^ (addr >> BLOCK_HASH_BITS)) & (BLOCK_HASH_SIZE - 1);
+}
+
+static void block_flush(struct block_cache *bc)
+{
+    for (unsigned i = 0; i < countof(bc->buckets); i++) {
+        list_foreach(block, b, bc->buckets[i])
+            free(b);
+        bc->buckets[i] = NULL;
+    }
+
+    if (bc->lo <= bc->hi)
+        memset(&bc->code[bc->lo / CHAR_BIT], 0, bc->hi / CHAR_BIT - bc->lo / CHAR_BIT + 1);
+
+    if (bc->jit)
+        jit_reset(bc->jit);
+
+    bc->lo = PTR_MASK;
+    bc->hi = 0;
+    bc->count = 0;
+    bc->flush_pending = 0;
+}
+
+static struct block *block_find(struct block_cache *bc, uint32_t addr)
+{
+    list_foreach(block, b, bc->buckets[block_hash(addr)])
+        if (b->addr == addr)
+            return b;
+
+    return NULL;
+}
+
+static struct block *block_make(struct sim_state *s, struct block_cache *bc,
+        uint32_t addr)
+{
+    struct decoded insns[BLOCK_MAX_LEN];
+    uint32_t len = 0;
+
+    for (uint32_t a = addr; len < BLOCK_MAX_LEN; a++) {
+        uint32_t word;
+        if (s->dispatch_op(s, OP_READ, a, &word))
+            break;
+
+        struct decoded *d = &insns[len++];
+        decode(d, a, word);
+        // illegal instructions and writes to P end a block, as does the end
+        // of the address space
+        if (d->run == run_illegal || (d->z == 15 && d->dd < 2) || a == PTR_MASK)
+            break;
+    }
+
+    if (len == 0)
+        return NULL;
+
+    struct block *b = malloc(sizeof *b + len * sizeof *b->insns);
+    b->addr = addr;
+    b->len = len;
+    b->hits = 0;
+    b->native = NULL;
+    b->loads = b->stores = 0;
+    for (uint32_t k = 0; k < len; k++) {
+        b->loads  += insns[k].dd == 1;
+        b->stores += insns[k].dd >= 2;
+    }
+    b->succ[0] = b->succ[1] = NULL;
+    memcpy(b->insns, insns, len * sizeof *b->insns);
+
+    unsigned h = block_hash(addr);
+    b->next = bc->buckets[h];
+    bc->buckets[h] = b;
+    bc->count++;
+
+    for (uint32_t a = addr; a < addr + len; a++)
+        bc->code[a / CHAR_BIT] |= 1 << (a % CHAR_BIT);
+
+    bc->lo = MIN(bc->lo, addr);
+    bc->hi = MAX(bc->hi, addr + len - 1);
+
+    return b;
+}
+
+static int run_block(struct sim_state *s, struct block *b, struct run_ops *ops)
+{
+    for (struct decoded *d = b->insns; d < b->insns + b->len; d++) {
         struct instruction i;
-        s->dispatch_op(s, OP_READ, s->machine.regs[15], &i.u.word);
+        i.u.word = d->word;
 
         if (ops->pre_insn)
             ops->pre_insn(s, &i);
 
-        if (run_instruction(s, &i))
+        if (d->run(s, d))
             return 1;
 
         if (ops->post_insn)
             ops->post_insn(s, &i);
+
+        retire(s, ops, 1);
+
+        // the rest of this block may be stale, or an interrupt may be due
+        if (s->blocks->flush_pending || s->machine.irq.ready)
+            break;
+    }
+
+    return 0;
+}
+
+static int jit_mem(struct jit_ctx *c, int op, uint32_t addr)
+{
+    struct sim_state *s = c->ud;
+    struct block_cache *bc = s->blocks;
+
+    uint64_t next_event = s->machine.next_event;
+    s->dispatch_op(s, op | OP_DATA, addr, &c->data);
+    if (op == OP_WRITE) {
+        note_write(s, addr);
+        // stop if the rest of this block is stale, if a device will need to
+        // act before the block would have ended, or if an interrupt is due
+        if (bc->flush_pending || s->machine.next_event < next_event ||
+                s->machine.irq.ready)
+            c->stop = JIT_STOP;
+    }
+
+    if (bc->jit_check)
+        bc->log[bc->log_count++] = (struct jit_access){ op, addr, c->data };
+
+    return 0;
+}
+
+static struct run_ops *jit_ops;
+
+static int jit_post(struct jit_ctx *c, uint32_t word)
+{
+    struct instruction i;
+    i.u.word = word;
+    return jit_ops->post_insn(c->ud, &i);
+}
+
+static void block_compile(struct sim_state *s, struct block_cache *bc,
+        struct block *b, struct run_ops *ops)
+{
+    struct jit_insn insns[BLOCK_MAX_LEN];
+
+    // leave illegal instructions, reserved opcodes and wrapping of P to the
+    // interpreter
+    if (b->addr + b->len - 1 >= PTR_MASK)
+        return;
+
+    for (uint32_t k = 0; k < b->len; k++) {
+        struct decoded *d = &b->insns[k];
+        if (d->run == run_illegal || d->run == run_reserved)
+            return;
+
+        struct instruction i = { .u.word = d->word };
+        insns[k] = (struct jit_insn){
+            .addr = d->addr, .word = d->word, .imm = d->imm,
+            .op = i.u._0xxx.op, .x = d->x, .y = d->y, .z = d->z,
+            .dd = d->dd, .p = d->p,
+        };
+    }
+
+    jit_ops = ops;
+    struct jit_helpers h = {
+        .mem  = jit_mem,
+        .post = ops->post_insn ? jit_post : NULL,
+        // loads must go through jit_mem to be checked, or to be counted by
+        // device
+        .page_mem = (bc->jit_check || s->conf.stats) ? NULL : s->machine.page_read,
+    };
+
+    // if the code space is full, start again from nothing after this block
+    if (!(b->native = jit_compile(bc->jit, b->len, insns, &h)))
+        bc->flush_pending = 1;
+}
+
+struct replay {
+    struct sim_state s;     ///< must be first, since it is dispatch_op's ud
+    struct block_cache *bc;
+    size_t pos;             ///< next entry in bc->log
+    int bad;
+};
+
+// satisfies memory operations from the log made by a translated block
+static int replay_op(void *ud, int op, uint32_t addr, uint32_t *data)
+{
+    struct replay *r = ud;
+    op &= ~OP_DATA;
+
+    if (r->pos >= r->bc->log_count) {
+        r->bad = 1;
+        return -1;
+    }
+
+    struct jit_access *a = &r->bc->log[r->pos++];
+    if (a->op != op || a->addr != addr || (op == OP_WRITE && a->data != *data))
+        r->bad = 1;
+
+    if (op == OP_READ)
+        *data = a->data;
+
+    return 0;
+}
+
+// runs the block that b->native just ran, through run_instruction(), and
+// stops the simulation if the results differ
+static void block_check(struct sim_state *s, struct block_cache *bc,
+        struct block *b, int32_t before[16], uint32_t count)
+{
+    struct replay r = { .s = *s, .bc = bc, .pos = 0, .bad = 0 };
+    r.s.dispatch_op = replay_op;
+    r.s.icache = NULL;
+    r.s.blocks = NULL;
+    memcpy(r.s.machine.regs, before, sizeof r.s.machine.regs);
+
+    for (uint32_t k = 0; k < count; k++) {
+        struct instruction i;
+        i.u.word = b->insns[k].word;
+        if (run_instruction(&r.s, &i))
+            r.bad = 1;
     }
+
+    if (r.pos != bc->log_count)
+        r.bad = 1;
+
+    if (r.bad || memcmp(r.s.machine.regs, s->machine.regs, sizeof r.s.machine.regs)) {
+        fputs("run_instruction() gives\n", stderr);
+        print_registers(stderr, r.s.machine.regs);
+        fputs("\ntranslated code gives\n", stderr);
+        print_registers(stderr, s->machine.regs);
+        fputc('\n', stderr);
+        fatal(0, "Translated block at %#x disagrees with run_instruction()", b->addr);
+    }
+}
+
+static int run_native(struct sim_state *s, struct block_cache *bc,
+        struct block *b, struct run_ops *ops)
+{
+    int32_t before[16];
+    if (bc->jit_check) {
+        memcpy(before, s->machine.regs, sizeof before);
+        bc->log_count = 0;
+    }
+
+    bc->ctx.stop = 0;
+    int rc = b->native(&bc->ctx);
+    if (rc == JIT_STOP)
+        rc = 0;
+
+    uint32_t count = bc->ctx.stop ? s->machine.regs[15] - b->addr : b->len;
+    if (bc->jit_check && !rc)
+        block_check(s, bc, b, before, count);
+
+    struct counters *n = &s->machine.counters;
+    if (count == b->len) {
+        struct decoded *last = &b->insns[b->len - 1];
+        n->loads += b->loads;
+        n->stores += b->stores;
+        if (last->z == 15 && last->dd < 2 && (uint32_t)s->machine.regs[15] != last->addr + 1)
+            n->transfers++;
+    } else {
+        for (uint32_t k = 0; k < count; k++) {
+            n->loads  += b->insns[k].dd == 1;
+            n->stores += b->insns[k].dd >= 2;
+        }
+    }
+
+    retire(s, ops, count);
+
+    return rc;
+}
+
+int run_blocks(struct sim_state *s, struct run_ops *ops)
+{
+    int rc = 0;
+    struct spin spin = { .countdown = SPIN_INTERVAL };
+    struct block_cache *bc = s->blocks = calloc(1, sizeof *bc);
+    bc->lo = PTR_MASK;
+    bc->hi = 0;
+
+    // translations skip the pre_insn hook, so they are not used when tracing ;
+    // they also update counters only as they exit, so they are not used when
+    // the program can read counters
+    if (s->conf.jit && !ops->pre_insn && !s->conf.counters &&
+            (bc->jit = jit_init(JIT_CODE_SIZE))) {
+        const char *val;
+        bc->jit_threshold = JIT_THRESHOLD;
+        if (param_get(s, "jit.threshold", &val))
+            bc->jit_threshold = strtoul(val, NULL, 0);
+        bc->jit_check = param_get(s, "jit.check", &val) && strtol(val, NULL, 0);
+        bc->ctx = (struct jit_ctx){ .regs = s->machine.regs, .ud = s };
+    }
+
+    struct block *prev = NULL;
+    while (!rc) {
+        // interrupts are taken between blocks, which end early for them
+        if (s->machine.irq.ready && interrupt(s, ops)) {
+            rc = 1;
+            break;
+        }
+
+        uint32_t pc = s->machine.regs[15];
+        assert(("PC within address space", !(pc & ~PTR_MASK)));
+
+        struct block *b = NULL;
+        if (prev && prev->succ[0] && prev->succ[0]->addr == pc) {
+            b = prev->succ[0];
+        } else if (prev && prev->succ[1] && prev->succ[1]->addr == pc) {
+            b = prev->succ[1];
+            prev->succ[1] = prev->succ[0];
+            prev->succ[0] = b;
+        } else {
+            if (bc->count >= BLOCK_MAX_COUNT) {
+                block_flush(bc);
+                prev = NULL;
+            }
+
+            if (!(b = block_find(bc, pc)) && !(b = block_make(s, bc, pc))) {
+                rc = 1;
+                break;
+            }
+
+            if (prev) {
+                prev->succ[1] = prev->succ[0];
+                prev->succ[0] = b;
+            }
+        }
+
+        if (bc->jit && b->hits++ == bc->jit_threshold)
+            block_compile(s, bc, b, ops);
+
+        // translations count instructions only at their end, so they are not
+        // used when a device will be due before then
+        if (b->native && s->machine.cycles + b->len <= s->machine.next_event)
+            rc = run_native(s, bc, b, ops);
+        else
+            rc = run_block(s, b, ops);
+
+        uint32_t last = b->addr + b->len - 1;
+        if (!rc && (uint32_t)s->machine.regs[15] <= last && !--spin.countdown)
+            rc = spin_check(s, ops, &spin);
+
+        prev = b;
+
+        if (bc->flush_pending) {
+            block_flush(bc);
+            prev = NULL;
+        }
+    }
+
+    block_flush(bc);
+    if (bc->jit)
+        jit_fini(bc->jit);
+    free(bc);
+    s->blocks = NULL;
+
+    return rc;
+}
+
+static int compare_symbols(const void *_a, const void *_b)
+{
+    const struct sim_symbol *a = _a, *b = _b;
+    return (a->addr > b->addr) - (a->addr < b->addr);
 }
 
-int load_sim(op_dispatcher *dispatch_op, void *sud, const struct format *f,
-        FILE *in, int load_address)
+static void load_block(struct sim_state *s, uint32_t addr, size_t count,
+        const uint32_t *data)
 {
-    void *ud;
+    // writes do not modify what they are given
+    if (s->dispatch_block) {
+        s->dispatch_block(s, OP_WRITE, addr, count, (uint32_t*)data);
+        return;
+    }
+
+    for (size_t k = 0; k < count; k++) {
+        uint32_t word = data[k];
+        s->dispatch_op(s, OP_WRITE, addr + k, &word);
+    }
+}
+
+int load_sim(struct sim_state *s, const struct format *f, FILE *in,
+        int load_address)
+{
+    void *ud = NULL;
     if (f->init)
         f->init(in, ASM_DISASSEMBLE, &ud);
 
-    struct instruction i;
-    while (f->in(in, &i, ud) > 0) {
-        // TODO stop assuming addresses are contiguous and monotonic
-        dispatch_op(sud, OP_WRITE, load_address++, &i.u.word);
+    // TODO stop assuming addresses are contiguous and monotonic
+    uint32_t addr = load_address;
+    if (f->block) {
+        const uint32_t *data;
+        long count;
+        while ((count = f->block(in, &data, ud)) > 0) {
+            load_block(s, addr, count, data);
+            addr += count;
+        }
+    } else {
+        struct instruction i;
+        while (f->in(in, &i, ud) > 0)
+            s->dispatch_op(s, OP_WRITE, addr++, &i.u.word);
     }
 
+    // keep global symbols for symbolising addresses later
+    struct symbol sym;
+    size_t size = 0;
+    while (f->sym && f->sym(in, &sym, ud) > 0) {
+        if (s->symbols_count >= size) {
+            size = size ? size * 2 : 16;
+            s->symbols = realloc(s->symbols, size * sizeof *s->symbols);
+        }
+
+        struct sim_symbol *ss = &s->symbols[s->symbols_count++];
+        ss->addr = (load_address + sym.reladdr) & PTR_MASK;
+        strcopy(ss->name, sym.name, sizeof ss->name);
+    }
+
+    qsort(s->symbols, s->symbols_count, sizeof *s->symbols, compare_symbols);
+
     if (f->fini)
         f->fini(in, &ud);
 
@@ -10,10 +10,18 @@
 #include <stdio.h>
 
 struct sim_state;
+struct icache;
+struct block_cache;
+struct prof;
+struct trace;
+struct undo_log;
 
 typedef int recipe(struct sim_state *s);
 
 enum memory_op { OP_READ=0, OP_WRITE=1 };
+/// or-ed into the op given to an op_dispatcher for a load or store made by an
+/// instruction, rather than a fetch or an inspection ; devices never see it
+#define OP_DATA 2
 
 struct recipe_book {
     recipe *recipe;
@@ -21,6 +29,15 @@ struct recipe_book {
 };
 
 typedef int op_dispatcher(void *ud, int op, uint32_t addr, uint32_t *data);
+/// like op_dispatcher, but for count consecutive words (OP_DATA is not used)
+typedef int block_dispatcher(void *ud, int op, uint32_t addr, uint32_t count,
+        uint32_t *data);
+
+/// a global symbol from the loaded image, at its load address
+struct sim_symbol {
+    uint32_t addr;
+    char name[SYMBOL_LEN];
+};
 
 struct sim_state {
     struct {
@@ -30,6 +47,10 @@ struct sim_state {
         int run_defaults;   ///< whether to run default recipes
         int debugging;
         int should_init;
+        int blocks;         ///< whether to use run_blocks() instead of run_sim()
+        int jit;            ///< whether run_blocks() translates hot blocks
+        int stats;          ///< whether to print counters on exit
+        int counters;       ///< whether counters are visible to the program
         uint32_t initval;
 
 #define DEFAULT_PARAMS_COUNT 16
@@ -43,6 +64,17 @@ struct sim_state {
     } conf;
 
     op_dispatcher *dispatch_op;
+    block_dispatcher *dispatch_block;   ///< optional ; else dispatch_op per word
+
+    struct icache *icache;  ///< predecoded instructions, owned by run_sim()
+    struct block_cache *blocks; ///< basic blocks, owned by run_blocks()
+    struct prof *prof;      ///< sampling profiler, if one is running
+    struct trace *trace;    ///< binary trace being written, if any
+    struct undo_log *undo;  ///< record of overwritten state, if any
+    struct run_ops *run_ops;    ///< hooks for run_events(), if any
+
+    size_t symbols_count;
+    struct sim_symbol *symbols; ///< sorted by address, filled by load_sim()
 
     struct recipe_book *recipes;
 
@@ -52,12 +84,26 @@ struct sim_state {
 struct run_ops {
     int (*pre_insn)(struct sim_state *s, struct instruction *i);
     int (*post_insn)(struct sim_state *s, struct instruction *i);
+    /// called after an instruction that brings machine.cycles up to
+    /// machine.next_event, which it is expected to move forward
+    int (*event)(struct sim_state *s);
 };
 
 int run_instruction(struct sim_state *s, struct instruction *i);
+/// does what @c run_sim() does between instructions after one run by @c
+/// run_instruction() : lets any device that is now due act, and takes an
+/// interrupt that is ready ; returns nonzero if the program waits for an
+/// interrupt that cannot come
+int run_events(struct sim_state *s, struct run_ops *ops);
 int run_sim(struct sim_state *s, struct run_ops *ops);
-int load_sim(op_dispatcher *dispatch_op, void *sud, const struct format *f,
-        FILE *in, int load_address);
+/// like @c run_sim(), but executes translated basic blocks
+int run_blocks(struct sim_state *s, struct run_ops *ops);
+int load_sim(struct sim_state *s, const struct format *f, FILE *in,
+        int load_address);
+/// keeps predecoded instructions coherent with count words written from addr ;
+/// stores made by instructions are handled already, so this is for every other
+/// way of writing memory while a program runs
+void sim_note_write(struct sim_state *s, uint32_t addr, uint32_t count);
 
 /// @c param_get() returns true if key is found, false otherwise
 int param_get(struct sim_state *s, char *key, const char **val);
@@ -0,0 +1,132 @@
+#include "snapshot.h"
+#include "device.h"
+#include "common.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+void snapshot_put(FILE *out, const void *what, size_t size)
+{
+    if (size && fwrite(what, size, 1, out) != 1)
+        fatal(PRINT_ERRNO, "Unknown error in %s while writing snapshot", __func__);
+}
+
+void snapshot_get(FILE *in, void *what, size_t size)
+{
+    if (size && fread(what, size, 1, in) != 1)
+        fatal(PRINT_ERRNO, "Unknown error in %s while reading snapshot", __func__);
+}
+
+// Each device's state is preceded by its bounds, which identify it on restore,
+// and by the length of the state, which is filled in once it is written.
+static int save_device(struct sim_state *s, struct device *d, FILE *out)
+{
+    SNAPSHOT_PUT(d->bounds, out);
+
+    uint64_t size = 0;
+    long where = ftell(out);
+    SNAPSHOT_PUT(size, out);
+    if (d->serialize)
+        d->serialize(s, d->cookie, out);
+
+    long end = ftell(out);
+    size = end - where - sizeof size;
+    if (where < 0 || end < 0 || fseek(out, where, SEEK_SET))
+        fatal(PRINT_ERRNO, "Snapshots can only be written to seekable files");
+    SNAPSHOT_PUT(size, out);
+    fseek(out, end, SEEK_SET);
+
+    return 0;
+}
+
+int snapshot_save(struct sim_state *s, FILE *out)
+{
+    snapshot_put(out, SNAPSHOT_MAGIC, 3);
+    uint8_t version = SNAPSHOT_VERSION;
+    SNAPSHOT_PUT(version, out);
+
+    SNAPSHOT_PUT(s->machine.regs, out);
+    SNAPSHOT_PUT(s->machine.cycles, out);
+#define PUT_COUNTER(Name,Desc) SNAPSHOT_PUT(s->machine.counters.Name, out);
+    COUNTERS(PUT_COUNTER)
+#undef PUT_COUNTER
+    SNAPSHOT_PUT(s->machine.irq.pending, out);
+    SNAPSHOT_PUT(s->machine.irq.enabled, out);
+    SNAPSHOT_PUT(s->machine.irq.vector, out);
+    SNAPSHOT_PUT(s->machine.irq.saved, out);
+    SNAPSHOT_PUT(s->machine.irq.ie, out);
+    SNAPSHOT_PUT(s->machine.irq.waiting, out);
+    SNAPSHOT_PUT(s->machine.irq.shadow, out);
+    SNAPSHOT_PUT(s->machine.irq.shadowed, out);
+
+    uint32_t count = s->machine.devices_count;
+    SNAPSHOT_PUT(count, out);
+    for (size_t i = 0; i < s->machine.devices_count; i++)
+        save_device(s, s->machine.devices[i], out);
+
+    return 0;
+}
+
+int snapshot_load(struct sim_state *s, FILE *in)
+{
+    char magic[3];
+    uint8_t version;
+    SNAPSHOT_GET(magic, in);
+    SNAPSHOT_GET(version, in);
+    if (memcmp(magic, SNAPSHOT_MAGIC, sizeof magic) || version != SNAPSHOT_VERSION)
+        fatal(0, "Input is not a tsim snapshot of version %d", SNAPSHOT_VERSION);
+
+    SNAPSHOT_GET(s->machine.regs, in);
+    SNAPSHOT_GET(s->machine.cycles, in);
+#define GET_COUNTER(Name,Desc) SNAPSHOT_GET(s->machine.counters.Name, in);
+    COUNTERS(GET_COUNTER)
+#undef GET_COUNTER
+    SNAPSHOT_GET(s->machine.irq.pending, in);
+    SNAPSHOT_GET(s->machine.irq.enabled, in);
+    SNAPSHOT_GET(s->machine.irq.vector, in);
+    SNAPSHOT_GET(s->machine.irq.saved, in);
+    SNAPSHOT_GET(s->machine.irq.ie, in);
+    SNAPSHOT_GET(s->machine.irq.waiting, in);
+    SNAPSHOT_GET(s->machine.irq.shadow, in);
+    SNAPSHOT_GET(s->machine.irq.shadowed, in);
+    irq_update(&s->machine.irq);
+
+    uint32_t count;
+    SNAPSHOT_GET(count, in);
+    if (count != s->machine.devices_count)
+        fatal(0, "Snapshot has %u devices, but the machine has %zu", count,
+                s->machine.devices_count);
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t bounds[2];
+        uint64_t size;
+        SNAPSHOT_GET(bounds, in);
+        SNAPSHOT_GET(size, in);
+
+        // devices are kept in order, so they are restored in the same order
+        struct device *d = s->machine.devices[i];
+        if (d->bounds[0] != bounds[0] || d->bounds[1] != bounds[1])
+            fatal(0, "Snapshot has a device at %#x-%#x, but the machine does not",
+                    bounds[0], bounds[1]);
+
+        long start = ftell(in);
+        if (size && (!d->deserialize || d->deserialize(s, d->cookie, in)))
+            fatal(0, "Failed to restore device at %#x-%#x", bounds[0], bounds[1]);
+        if (start >= 0 && ftell(in) - start != (long)size)
+            fatal(0, "Device at %#x-%#x restored %ld bytes of %lu", bounds[0],
+                    bounds[1], ftell(in) - start, (unsigned long)size);
+
+        // let devices with cycle() hooks catch up from the restored count
+        d->deadline = s->machine.cycles;
+    }
+
+    s->machine.next_event = 0;
+
+    // memory may have moved, so the dispatch table must be built again
+    for (uint32_t page = 0; page < DISPATCH_PAGES; page++)
+        device_map_page(s, s->machine.page_device[page], page);
+
+    return 0;
+}
+
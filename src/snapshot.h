@@ -0,0 +1,29 @@
+/*
+ * Saves and restores the state of a simulation : the machine, and each device
+ * that has a serialize() hook. A snapshot can be restored only into a machine
+ * that has the same devices, configured in the same way.
+ */
+
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+struct sim_state;
+
+#define SNAPSHOT_MAGIC      "TSS"
+#define SNAPSHOT_VERSION    1
+
+int snapshot_save(struct sim_state *s, FILE *out);
+int snapshot_load(struct sim_state *s, FILE *in);
+
+/// for use by device hooks ; failures are fatal
+void snapshot_put(FILE *out, const void *what, size_t size);
+void snapshot_get(FILE *in, void *what, size_t size);
+
+#define SNAPSHOT_PUT(What,Where) snapshot_put(Where, &(What), sizeof (What))
+#define SNAPSHOT_GET(What,Where) snapshot_get(Where, &(What), sizeof (What))
+
+#endif
+
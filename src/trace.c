@@ -0,0 +1,43 @@
+#include "trace.h"
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct trace *trace_open(FILE *out, size_t size)
+{
+    struct trace_header h = { .version = TRACE_VERSION,
+                              .record_size = sizeof(struct trace_record) };
+    memcpy(h.magic, TRACE_MAGIC, sizeof h.magic);
+    if (fwrite(&h, sizeof h, 1, out) != 1)
+        return NULL;
+
+    struct trace *t = calloc(1, sizeof *t);
+    t->out = out;
+    t->size = size;
+    t->buf = malloc(size * sizeof *t->buf);
+    return t;
+}
+
+int trace_flush(struct trace *t)
+{
+    size_t count = t->count;
+    t->count = 0;
+    if (fwrite(t->buf, sizeof *t->buf, count, t->out) != count)
+        fatal(PRINT_ERRNO, "Failed to write trace");
+
+    return 0;
+}
+
+int trace_close(struct trace *t)
+{
+    if (t->pending)
+        t->count++;
+    trace_flush(t);
+
+    free(t->buf);
+    free(t);
+
+    return 0;
+}
+
@@ -0,0 +1,74 @@
+/*
+ * A compact binary record of execution : a header followed by one fixed-size
+ * record per instruction, in host byte order. Records are collected in a
+ * buffer and written out in large blocks.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_MAGIC     "TTR"
+#define TRACE_VERSION   0
+/// records collected before each write
+#define TRACE_BUFFER    16384
+
+struct trace_header {
+    char magic[3];      ///< TRACE_MAGIC, without its terminator
+    uint8_t version;
+    uint32_t record_size;
+};
+
+enum { TRACE_MEM = 1, TRACE_RETIRED = 2 };
+
+struct trace_record {
+    uint32_t pc;
+    uint32_t word;      ///< instruction encoding
+    uint32_t flags;     ///< TRACE_MEM and TRACE_RETIRED
+    uint32_t value;     ///< register Z after the instruction, if retired
+    uint32_t addr;      ///< address of the memory operand, if TRACE_MEM
+    uint32_t data;      ///< word loaded or stored, if TRACE_MEM
+};
+
+struct trace {
+    FILE *out;
+    size_t size;        ///< records in buf
+    size_t count;       ///< records in buf that are complete
+    int pending;        ///< whether buf[count] has been begun
+    struct trace_record *buf;
+};
+
+struct trace *trace_open(FILE *out, size_t size);
+/// writes out the complete records in the buffer
+int trace_flush(struct trace *t);
+/// writes out any records, including one left incomplete, and frees t
+int trace_close(struct trace *t);
+
+static inline void trace_begin(struct trace *t, uint32_t pc, uint32_t word)
+{
+    t->buf[t->count] = (struct trace_record){ .pc = pc, .word = word };
+    t->pending = 1;
+}
+
+static inline void trace_mem(struct trace *t, uint32_t addr, uint32_t data)
+{
+    struct trace_record *r = &t->buf[t->count];
+    r->flags |= TRACE_MEM;
+    r->addr = addr;
+    r->data = data;
+}
+
+static inline void trace_end(struct trace *t, uint32_t value)
+{
+    struct trace_record *r = &t->buf[t->count];
+    r->flags |= TRACE_RETIRED;
+    r->value = value;
+    t->pending = 0;
+    if (++t->count == t->size)
+        trace_flush(t);
+}
+
+#endif
+
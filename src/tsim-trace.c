@@ -0,0 +1,121 @@
+#include "ops.h"
+#include "asm.h"
+#include "common.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <string.h>
+
+#if _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+static const char shortopts[] = "hV";
+
+static const struct option longopts[] = {
+    { "help"        ,       no_argument, NULL, 'h' },
+    { "version"     ,       no_argument, NULL, 'V' },
+
+    { NULL, 0, NULL, 0 },
+};
+
+#define version() "tsim-trace version " STR(BUILD_NAME)
+
+static int usage(const char *me)
+{
+    printf("Usage: %s [ OPTIONS ] trace-file\n"
+           "Disassembles a trace written by `tsim --trace'.\n"
+           "Options:\n"
+           "  -h, --help            display this message\n"
+           "  -V, --version         print the string '%s'\n"
+           , me, version());
+
+    return 0;
+}
+
+static int print_record(FILE *out, const struct trace_record *r)
+{
+    struct instruction i = { .u.word = r->word };
+    fprintf(out, "0x%06x\t", r->pc);
+    int len = print_disassembly(out, &i, ASM_AS_INSN);
+    fprintf(out, "%*s# ", 30 - len, "");
+
+    if (r->flags & TRACE_RETIRED)
+        fprintf(out, "%c = 0x%08x", 'A' + i.u._0xxx.z, r->value);
+    else
+        fputs("not retired", out);
+
+    if (r->flags & TRACE_MEM)
+        fprintf(out, "  [0x%06x] %s 0x%08x", r->addr,
+                i.u._0xxx.dd >= 2 ? "<-" : "->", r->data);
+
+    fputc('\n', out);
+
+    return 0;
+}
+
+static int do_decode(FILE *in, FILE *out)
+{
+    struct trace_header h;
+    if (fread(&h, sizeof h, 1, in) != 1 ||
+            memcmp(h.magic, TRACE_MAGIC, sizeof h.magic))
+        fatal(0, "Input is not a tsim trace");
+    if (h.version != TRACE_VERSION || h.record_size != sizeof(struct trace_record))
+        fatal(0, "Unsupported trace version %d (record size %u)", h.version,
+                (unsigned)h.record_size);
+
+    struct trace_record *buf = malloc(TRACE_BUFFER * sizeof *buf);
+    size_t count;
+    while ((count = fread(buf, sizeof *buf, TRACE_BUFFER, in)) > 0)
+        for (size_t k = 0; k < count; k++)
+            print_record(out, &buf[k]);
+
+    free(buf);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int rc = 0;
+
+    if ((rc = setjmp(errbuf))) {
+        if (rc == DISPLAY_USAGE)
+            usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int ch;
+    while ((ch = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1) {
+        switch (ch) {
+            case 'V': puts(version()); return EXIT_SUCCESS;
+            case 'h': usage(argv[0]); return EXIT_SUCCESS;
+            default : usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+
+    if (optind >= argc)
+        fatal(DISPLAY_USAGE, "No input files specified on the command line");
+
+    FILE *in = stdin;
+    if (!strcmp(argv[optind], "-")) {
+        // ensure we are in binary mode on Windows
+        if (freopen(NULL, "rb", stdin) == 0)
+#if _WIN32
+            if (setmode(0, O_BINARY) == -1)
+#endif
+                fatal(0, "Failed to set binary mode on stdin");
+    } else if (!(in = fopen(argv[optind], "rb"))) {
+        fatal(PRINT_ERRNO, "Failed to open input file `%s'", argv[optind]);
+    }
+
+    do_decode(in, stdout);
+
+    fclose(in);
+
+    return rc;
+}
+
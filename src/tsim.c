@@ -5,13 +5,23 @@
 #include "asm.h"
 #include "device.h"
 #include "sim.h"
+#include "prof.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "undo.h"
 // for RAM_BASE
 #include "devices/ram.h"
 #include "ffi.h"
 
+#include "debugger_global.h"
+
 struct breakpoint {
     uint32_t addr;
     unsigned enabled:1;
+    unsigned conditional:1; ///< whether cond must hold for us to stop
+    uint32_t after;         ///< hits needed before we stop, or 0
+    uint32_t hits;          ///< times reached with any condition holding
+    struct debug_cond cond;
 };
 
 #define KV_KEY_TYPE  uint32_t
@@ -19,25 +29,34 @@ struct breakpoint {
 #define KV_VAL_EMPTY NULL
 #include "kv_int.h"
 
-#include "debugger_global.h"
 #include "debugger_parser.h"
 #include "debugger_lexer.h"
 
 #include <assert.h>
+#include <ctype.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <getopt.h>
 #include <string.h>
 #include <strings.h>
 #include <search.h>
+#include <stdarg.h>
 
 #define RECIPES(_) \
     _(abort   , "call abort() when an illegal instruction is simulated") \
-    _(prealloc, "preallocate memory (higher memory footprint, maybe faster)") \
+    _(blocks  , "execute translated basic blocks (faster)") \
+    _(counters, "map performance counters into memory at 0x100") \
+    _(dma     , "enable a DMA controller at 0x300") \
+    _(intc    , "enable an interrupt controller at 0x320") \
+    _(prealloc, "reserve all memory up front (replaces sparse)") \
+    _(profile , "profile execution, writing samples by function on exit") \
     _(sparse  , "use sparse memory (lower memory footprint, maybe slower)") \
-    _(serial  , "enable simple serial device and connect to stdio") \
+    _(serial  , "enable buffered serial device (stdio by default) at 0x20") \
     _(spi     , "enable SPI emulation") \
+    _(timer   , "enable a timer at 0x330") \
     _(inittrap, "initialise unused memory to the illegal instruction") \
+    _(jit     , "translate hot basic blocks to native code (implies blocks)") \
     _(nowrap  , "stop when PC wraps around 24-bit boundary")
 
 #define DEFAULT_RECIPES(_) \
@@ -62,42 +81,197 @@ static int next_device(struct sim_state *s)
     return s->machine.devices_count++;
 }
 
+typedef int device_adder(struct device **device);
+
+// kinds of device that can be moved with parameter <name>.base, and of which
+// further instances can be added by giving them a base, as with
+// -p serial1.base=0x30
+#define INSTANCES(_) \
+    _(dma)    \
+    _(serial) \
+    _(spi)    \
+    _(timer)
+
+#define DeclareAdder(Kind) device_adder Kind##_add_device;
+INSTANCES(DeclareAdder)
+
+// adds a device made by add, naming it name
+static struct device *add_device(struct sim_state *s, const char *name,
+        device_adder *add)
+{
+    int index = next_device(s);
+    struct device **d = &s->machine.devices[index];
+    *d = malloc(sizeof **d);
+    add(d);
+    snprintf((*d)->name, sizeof (*d)->name, "%s", name);
+    return *d;
+}
+
+// returns the index of the first device named name, or -1 if none was added
+static int find_named_device(struct sim_state *s, const char *name)
+{
+    for (size_t i = 0; i < s->machine.devices_count; i++)
+        if (!strcmp(s->machine.devices[i]->name, name))
+            return (int)i;
+
+    return -1;
+}
+
+// removes every device named name that has been added
+static void remove_device(struct sim_state *s, const char *name)
+{
+    int i;
+    while ((i = find_named_device(s, name)) >= 0) {
+        free(s->machine.devices[i]);
+        s->machine.devices[i] = s->machine.devices[--s->machine.devices_count];
+    }
+}
+
+// adds a device like add_device(), placing it at <name>.base if that is set
+static int add_instance(struct sim_state *s, const char *name, device_adder *add)
+{
+    struct device *d = add_device(s, name, add);
+
+    const char *val;
+    if (device_param_get(s, d, "base", &val)) {
+        uint32_t last = d->bounds[1] - d->bounds[0];
+        unsigned long base = strtoul(val, NULL, 0);
+        if (base > PTR_MASK || last > PTR_MASK - base)
+            fatal(0, "Device %s does not fit at %#lx", d->name, base);
+        d->bounds[0] = base;
+        d->bounds[1] = base + last;
+    }
+
+    return 0;
+}
+
+// adds an instance for every parameter <kind><number>.base
+static int add_instances(struct sim_state *s)
+{
+    static const struct {
+        const char *kind;
+        device_adder *add;
+    } kinds[] = {
+        #define KindEntry(Kind) { STR(Kind), Kind##_add_device },
+        INSTANCES(KindEntry)
+    };
+
+    for (size_t i = 0; i < s->conf.params_count; i++) {
+        const char *key = s->conf.params[i].key;
+        const char *dot = strchr(key, '.');
+        if (!dot || strcmp(dot, ".base"))
+            continue;
+
+        size_t len = dot - key;
+        size_t digits = 0;
+        while (digits < len && isdigit((unsigned char)key[len - digits - 1]))
+            digits++;
+        if (!digits || digits == len)
+            continue;
+
+        for (size_t k = 0; k < countof(kinds); k++) {
+            size_t kind_len = len - digits;
+            if (strlen(kinds[k].kind) != kind_len || strncmp(key, kinds[k].kind, kind_len))
+                continue;
+
+            char name[DEVICE_NAME_LEN];
+            if (len >= sizeof name)
+                fatal(0, "Device name in parameter `%s' is too long", key);
+            snprintf(name, sizeof name, "%.*s", (int)len, key);
+            add_instance(s, name, kinds[k].add);
+        }
+    }
+
+    return 0;
+}
+
 static int recipe_abort(struct sim_state *s)
 {
     s->conf.abort = 1;
     return 0;
 }
 
+static int recipe_blocks(struct sim_state *s)
+{
+    s->conf.blocks = 1;
+    return 0;
+}
+
+static int recipe_jit(struct sim_state *s)
+{
+    s->conf.blocks = 1;
+    s->conf.jit = 1;
+    return 0;
+}
+
+static int recipe_counters(struct sim_state *s)
+{
+    int counters_add_device(struct device **device);
+    add_device(s, "counters", counters_add_device);
+    s->conf.counters = 1;
+    return 0;
+}
+
+// moves dma.rate words per cycle
+static int recipe_dma(struct sim_state *s)
+{
+    return add_instance(s, "dma", dma_add_device);
+}
+
+static int recipe_intc(struct sim_state *s)
+{
+    int intc_add_device(struct device **device);
+    add_device(s, "intc", intc_add_device);
+    return 0;
+}
+
+// ram.hugepages=1 asks the host for transparent huge pages, and ram.image
+// names a raw image to map as the initial contents of memory from RAM_BASE ;
+// it takes the place of sparse (a default recipe) wherever that appears
 static int recipe_prealloc(struct sim_state *s)
 {
     int ram_add_device(struct device **device);
-    int index = next_device(s);
-    s->machine.devices[index] = malloc(sizeof *s->machine.devices[index]);
-    return ram_add_device(&s->machine.devices[index]);
+    remove_device(s, "sparseram");
+    add_device(s, "ram", ram_add_device);
+    return 0;
+}
+
+// samples every prof.period instructions, writing a flat profile to stderr and
+// collapsed stacks to the file named by prof.folded
+static int recipe_profile(struct sim_state *s)
+{
+    const char *val;
+    uint64_t period = PROF_PERIOD;
+    if (param_get(s, "prof.period", &val))
+        period = strtoull(val, NULL, 0);
+    s->prof = prof_init(s, period);
+    return 0;
 }
 
 static int recipe_sparse(struct sim_state *s)
 {
     int sparseram_add_device(struct device **device);
-    int index = next_device(s);
-    s->machine.devices[index] = malloc(sizeof *s->machine.devices[index]);
-    return sparseram_add_device(&s->machine.devices[index]);
+    // prealloc takes precedence, whichever order the recipes run in
+    if (find_named_device(s, "ram") < 0)
+        add_device(s, "sparseram", sparseram_add_device);
+    return 0;
 }
 
+// serial.in and serial.out name files, or serial.socket a socket, to use
 static int recipe_serial(struct sim_state *s)
 {
-    int serial_add_device(struct device **device);
-    int index = next_device(s);
-    s->machine.devices[index] = malloc(sizeof *s->machine.devices[index]);
-    return serial_add_device(&s->machine.devices[index]);
+    return add_instance(s, "serial", serial_add_device);
 }
 
 static int recipe_spi(struct sim_state *s)
 {
-    int spi_add_device(struct device **device);
-    int index = next_device(s);
-    s->machine.devices[index] = malloc(sizeof *s->machine.devices[index]);
-    return spi_add_device(&s->machine.devices[index]);
+    return add_instance(s, "spi", spi_add_device);
+}
+
+// raises interrupt line timer.irq on expiry
+static int recipe_timer(struct sim_state *s)
+{
+    return add_instance(s, "timer", timer_add_device);
 }
 
 static int recipe_nowrap(struct sim_state *s)
@@ -132,32 +306,160 @@ static int find_device_by_addr(const void *_test, const void *_in)
     }
 }
 
-static int dispatch_op(void *ud, int op, uint32_t addr, uint32_t *data)
+// pages shared between devices, or only partly mapped, are searched
+static struct device *find_device(struct sim_state *s, uint32_t addr)
 {
-    struct sim_state *s = ud;
     size_t count = s->machine.devices_count;
-    struct device **device = bsearch(&addr, s->machine.devices, count, sizeof *device,
-            find_device_by_addr);
-    if (device == NULL || *device == NULL) {
+    struct device **found = bsearch(&addr, s->machine.devices, count,
+            sizeof *found, find_device_by_addr);
+    if (found == NULL || *found == NULL) {
         fprintf(stderr, "No device handles address %#x\n", addr);
-        return -1;
+        return NULL;
     }
+
+    return *found;
+}
+
+// lets a device act on a write, and uses memory that it allocates lazily
+// directly once it exists
+static void written(struct sim_state *s, struct device *device, uint32_t addr,
+        uint32_t count)
+{
+    // a write may change when a device next needs to act, so ask it again
+    // after this instruction
+    if (device->cycle) {
+        device->deadline = s->machine.cycles + 1;
+        s->machine.next_event = MIN(s->machine.next_event, device->deadline);
+    }
+
+    if (!device->page)
+        return;
+
+    uint32_t last = (addr + count - 1) >> DISPATCH_PAGE_BITS;
+    for (uint32_t page = addr >> DISPATCH_PAGE_BITS; page <= last; page++)
+        if (page < DISPATCH_PAGES && device == s->machine.page_device[page])
+            device_map_page(s, device, page);
+}
+
+static int dispatch_op(void *ud, int op, uint32_t addr, uint32_t *data)
+{
+    struct sim_state *s = ud;
+    uint32_t page = addr >> DISPATCH_PAGE_BITS;
+    struct device *device = NULL;
+    int counted = op & OP_DATA;
+    op &= ~OP_DATA;
+
+    if (page < DISPATCH_PAGES) {
+        uint32_t *mem = s->machine.page_mem[page];
+        if (mem) {
+            if (counted)
+                s->machine.page_device[page]->accesses++;
+
+            uint32_t *where = &mem[addr & DISPATCH_PAGE_MASK];
+            if (op == OP_WRITE)
+                *where = *data;
+            else if (op == OP_READ)
+                *data = *where;
+            else
+                return 1;
+
+            return 0;
+        }
+
+        const uint32_t *shared = s->machine.page_read[page];
+        if (shared && op == OP_READ) {
+            if (counted)
+                s->machine.page_device[page]->accesses++;
+
+            *data = shared[addr & DISPATCH_PAGE_MASK];
+            return 0;
+        }
+
+        device = s->machine.page_device[page];
+    }
+
+    if (!device && !(device = find_device(s, addr)))
+        return -1;
+
     // TODO don't send in the whole simulator state ? the op should have
     // access to some state, in order to redispatch and potentially use other
     // machine.devices, but it shouldn't see the whole state
-    return (*device)->op(s, (*device)->cookie, op, addr, data);
+    if (counted) {
+        device->accesses++;
+        if (op == OP_READ && !device->cycle && !device->page)
+            s->machine.volatile_loads = 1;
+    }
+
+    int rc = device->op(s, device->cookie, op | (counted & device->op_flags),
+            addr, data);
+    if (op == OP_WRITE)
+        written(s, device, addr, 1);
+
+    return rc;
 }
 
-static const char shortopts[] = "a:df:np:r:s:vhV";
+// splits a block at device boundaries, handing each piece to the device's
+// block operation if it has one, or else to dispatch_op() a word at a time
+static int dispatch_block(void *ud, int op, uint32_t addr, uint32_t count,
+        uint32_t *data)
+{
+    struct sim_state *s = ud;
+
+    while (count > 0) {
+        uint32_t page = addr >> DISPATCH_PAGE_BITS;
+        struct device *device = page < DISPATCH_PAGES ? s->machine.page_device[page] : NULL;
+        if (!device && !(device = find_device(s, addr)))
+            return -1;
+
+        uint32_t n = MIN(count, device->bounds[1] - addr + 1);
+        int rc = 0;
+        if (op == OP_READ && device->read_block) {
+            rc = device->read_block(s, device->cookie, addr, n, data);
+        } else if (op == OP_WRITE && device->write_block) {
+            rc = device->write_block(s, device->cookie, addr, n, data);
+            written(s, device, addr, n);
+        } else {
+            for (uint32_t k = 0; k < n && !rc; k++)
+                rc = dispatch_op(s, op, addr + k, &data[k]);
+        }
+
+        if (rc)
+            return rc;
+
+        addr += n;
+        data += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+// records the loads and stores made by instructions, for the trace
+static int trace_dispatch_op(void *ud, int op, uint32_t addr, uint32_t *data)
+{
+    struct sim_state *s = ud;
+    int rc = dispatch_op(ud, op, addr, data);
+    if (op & OP_DATA)
+        trace_mem(s->trace, addr, *data);
+
+    return rc;
+}
+
+static const char shortopts[] = "a:df:g:np:r:s:vhV";
 
 static const struct option longopts[] = {
     { "address"    , required_argument, NULL, 'a' },
     { "debug"      ,       no_argument, NULL, 'd' },
     { "format"     , required_argument, NULL, 'f' },
+    { "gdb"        , required_argument, NULL, 'g' },
     { "scratch"    ,       no_argument, NULL, 'n' },
     { "param"      , required_argument, NULL, 'p' },
     { "recipe"     , required_argument, NULL, 'r' },
+    { "restore"    , required_argument, NULL, 'R' },
+    { "save"       , required_argument, NULL, 'w' },
     { "start"      , required_argument, NULL, 's' },
+    { "stats"      ,       no_argument, NULL, 'S' },
+    { "trace"      , required_argument, NULL, 'T' },
     { "verbose"    ,       no_argument, NULL, 'v' },
 
     { "help"       ,       no_argument, NULL, 'h' },
@@ -181,15 +483,25 @@ static int usage(const char *me)
     char format_list[256];
     make_format_list(format_has_input, formats_count, formats, sizeof format_list, format_list, ", ");
 
-    printf("Usage: %s [ OPTIONS ] image-file\n"
+    printf("Usage: %s [ OPTIONS ] [ image-file ]\n"
            "Options:\n"
            "  -a, --address=N       load instructions into memory at word address N\n"
            "  -d, --debug           start the simulator in debugger mode\n"
            "  -f, --format=F        select input format (%s)\n"
+           "  -g, --gdb=WHERE       wait for GDB to connect to TCP port WHERE, or to a\n"
+           "                        Unix domain socket if WHERE is a path\n"
            "  -n, --scratch         don't run default recipes\n"
-           "  -p, --param=X=Y       set parameter X to value Y\n"
+           "  -p, --param=X=Y       set parameter X to value Y ; serial.base=N moves\n"
+           "                        the serial device, and serial1.base=N adds another\n"
+           "                        (likewise for dma, spi and timer)\n"
            "  -r, --recipe=R        run recipe R (see list below)\n"
+           "      --restore=FILE    start from a snapshot (image-file is then optional,\n"
+           "                        as it is with parameter ram.image)\n"
+           "      --save=FILE       write a snapshot when the simulation stops, or after\n"
+           "                        the number of instructions in parameter save.at\n"
            "  -s, --start=N         start execution at word address N\n"
+           "      --stats           print performance counters on exit\n"
+           "      --trace=FILE      write a binary execution trace to FILE (- for stdout)\n"
            "  -v, --verbose         increase verbosity of output\n"
            "\n"
            "  -h, --help            display this message\n"
@@ -235,14 +547,41 @@ static int devices_finalise(struct sim_state *s)
         //debugwrap_unwrap_device(&s->machine.devices[0]);
     }
 
-    // Devices must be in address order to allow later bsearch. Assume they do
-    // not overlap (overlap is illegal).
+    // Devices must be in address order to allow later bsearch, and must not
+    // overlap.
     qsort(s->machine.devices, s->machine.devices_count,
             sizeof *s->machine.devices, compare_devices_by_base);
 
+    for (unsigned i = 1; i < s->machine.devices_count; i++) {
+        const struct device *a = s->machine.devices[i - 1];
+        const struct device *b = s->machine.devices[i];
+        if (a->bounds[1] >= b->bounds[0])
+            fatal(0, "Devices %s and %s overlap at %#x", a->name, b->name,
+                    b->bounds[0]);
+    }
+
     for (unsigned i = 0; i < s->machine.devices_count; i++)
         if (s->machine.devices[i])
-            s->machine.devices[i]->init(s, &s->machine.devices[i]->cookie);
+            s->machine.devices[i]->init(s, &s->machine.devices[i]->cookie,
+                    s->machine.devices[i]);
+
+    // A page that lies wholly within one device is dispatched straight to it,
+    // and if that device is plain memory, its storage is used directly.
+    s->machine.page_device = calloc(DISPATCH_PAGES, sizeof *s->machine.page_device);
+    s->machine.page_mem = calloc(DISPATCH_PAGES, sizeof *s->machine.page_mem);
+    s->machine.page_read = calloc(DISPATCH_PAGES, sizeof *s->machine.page_read);
+    for (unsigned i = 0; i < s->machine.devices_count; i++) {
+        struct device *d = s->machine.devices[i];
+        if (!d)
+            continue;
+
+        uint32_t first = (d->bounds[0] + DISPATCH_PAGE_MASK) >> DISPATCH_PAGE_BITS;
+        uint32_t end = ((uint64_t)d->bounds[1] + 1) >> DISPATCH_PAGE_BITS;
+        for (uint32_t page = first; page < end && page < DISPATCH_PAGES; page++) {
+            s->machine.page_device[page] = d;
+            device_map_page(s, d, page);
+        }
+    }
 
     return 0;
 }
@@ -255,16 +594,97 @@ static int devices_teardown(struct sim_state *s)
     }
 
     free(s->machine.devices);
+    free(s->machine.page_device);
+    free(s->machine.page_mem);
+    free(s->machine.page_read);
 
     return 0;
 }
 
+// runs the cycle() hooks of the devices that are due, and finds out when the
+// next one will be due
 static int devices_dispatch_cycle(struct sim_state *s)
 {
-    for (size_t i = 0; i < s->machine.devices_count; i++)
-        if (s->machine.devices[i]->cycle)
-            if (s->machine.devices[i]->cycle(s, s->machine.devices[i]->cookie))
-                return 1;
+    int rc = 0;
+    uint64_t now = s->machine.cycles;
+    uint64_t next = UINT64_MAX;
+
+    for (size_t i = 0; i < s->machine.devices_count; i++) {
+        struct device *d = s->machine.devices[i];
+        if (!d->cycle)
+            continue;
+
+        if (d->deadline <= now && d->cycle(s, d->cookie, now, &d->deadline))
+            rc = 1;
+
+        next = MIN(next, d->deadline);
+    }
+
+    s->machine.next_event = next;
+
+    return rc;
+}
+
+static int save_state(struct sim_state *s, const char *name)
+{
+    FILE *out = fopen(name, "wb");
+    if (!out)
+        fatal(PRINT_ERRNO, "Failed to open snapshot file `%s'", name);
+
+    snapshot_save(s, out);
+    fclose(out);
+
+    return 0;
+}
+
+static int restore_state(struct sim_state *s, const char *name)
+{
+    FILE *in = fopen(name, "rb");
+    if (!in)
+        fatal(PRINT_ERRNO, "Failed to open snapshot file `%s'", name);
+
+    snapshot_load(s, in);
+    fclose(in);
+
+    return 0;
+}
+
+// the snapshot requested with --save, and the cycle at which to take it (or
+// zero to take it when the simulation stops)
+static struct {
+    const char *name;
+    uint64_t at;
+} save;
+
+static int dispatch_event(struct sim_state *s)
+{
+    int rc = devices_dispatch_cycle(s);
+    if (s->prof)
+        s->machine.next_event = MIN(s->machine.next_event, prof_event(s->prof, s));
+
+    if (save.at) {
+        if (s->machine.cycles >= save.at) {
+            save_state(s, save.name);
+            save.name = NULL;
+            save.at = 0;
+        } else {
+            s->machine.next_event = MIN(s->machine.next_event, save.at);
+        }
+    }
+
+    return rc;
+}
+
+static int write_profile(struct sim_state *s)
+{
+    const char *name = "tsim.folded";
+    param_get(s, "prof.folded", &name); // may not be set ; that's OK
+    FILE *folded = fopen(name, "w");
+    if (!folded)
+        fatal(PRINT_ERRNO, "Failed to open profile output file `%s'", name);
+
+    prof_write(s->prof, stderr, folded);
+    fclose(folded);
 
     return 0;
 }
@@ -286,6 +706,8 @@ static int run_recipes(struct sim_state *s)
         free(b);
     }
 
+    add_instances(s);
+
     return 0;
 }
 
@@ -322,15 +744,61 @@ static int add_recipe(struct sim_state *s, const char *name)
     }
 }
 
-static int set_breakpoint(void **breakpoints, int32_t addr)
+// marks or clears addr in the bitmap of enabled breakpoints
+static void mark_breakpoint(struct debugger_data *dd, uint32_t addr, int on)
 {
+    addr &= PTR_MASK;
+    unsigned char bit = 1u << (addr % CHAR_BIT);
+    if (on)
+        dd->bp_map[addr / CHAR_BIT] |= bit;
+    else
+        dd->bp_map[addr / CHAR_BIT] &= ~bit;
+}
+
+// reports a change to breakpoints or watchpoints, unless we are to keep quiet
+static void note(struct debugger_data *dd, const char *fmt, ...)
+{
+    if (dd->quiet)
+        return;
+
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+int tdbg_set_breakpoint(struct debugger_data *dd, int32_t addr, int cond,
+        uint32_t after)
+{
+    void **breakpoints = &dd->breakpoints;
     struct breakpoint *old = kv_int_get(breakpoints, addr);
-    if (old) {
+    if (cond && dd->cond.len < 0) {
+        fprintf(stderr, "Condition is too long (at most %d operations)\n", COND_LEN);
+        return -1;
+    } else if (cond || after) {
+        struct breakpoint bp = {
+            .enabled     = 1,
+            .addr        = addr,
+            .conditional = !!cond,
+            .after       = after,
+        };
+        if (cond)
+            bp.cond = dd->cond;
+        kv_int_put(breakpoints, addr, &bp);
+        mark_breakpoint(dd, addr, 1);
+        note(dd, "%s breakpoint at %#lx", old ? "Replaced" : "Added", (long unsigned)addr);
+        if (cond)
+            note(dd, " with a condition");
+        if (after)
+            note(dd, " after %lu hits", (long unsigned)after);
+        note(dd, "\n");
+    } else if (old) {
         if (!old->enabled) {
-            printf("Enabled previous breakpoint at %#lx\n", (long unsigned)old->addr);
+            note(dd, "Enabled previous breakpoint at %#lx\n", (long unsigned)old->addr);
             old->enabled = 1;
+            mark_breakpoint(dd, addr, 1);
         } else {
-            printf("Breakpoint already exists at %#lx\n", (long unsigned)old->addr);
+            note(dd, "Breakpoint already exists at %#lx\n", (long unsigned)old->addr);
         }
     } else {
         struct breakpoint bp = {
@@ -338,30 +806,352 @@ static int set_breakpoint(void **breakpoints, int32_t addr)
             .addr    = addr,
         };
         kv_int_put(breakpoints, addr, &bp);
-        printf("Added breakpoint at %#lx\n", (long unsigned)addr);
+        mark_breakpoint(dd, addr, 1);
+        note(dd, "Added breakpoint at %#lx\n", (long unsigned)addr);
     }
 
     return 0;
 }
 
-static int delete_breakpoint(void **breakpoints, int32_t addr)
+int tdbg_delete_breakpoint(struct debugger_data *dd, int32_t addr)
 {
-    struct breakpoint *old = kv_int_remove(breakpoints, addr);
+    struct breakpoint *old = kv_int_remove(&dd->breakpoints, addr);
     if (old) {
-        printf("Removed breakpoint at %#lx\n", (long unsigned)addr);
+        mark_breakpoint(dd, addr, 0);
+        note(dd, "Removed breakpoint at %#lx\n", (long unsigned)addr);
     } else {
-        printf("No breakpoint at %#lx\n", (long unsigned)addr);
+        note(dd, "No breakpoint at %#lx\n", (long unsigned)addr);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int32_t eval_cond(struct sim_state *s, const struct debug_cond *c)
+{
+    int32_t stack[COND_LEN], a, b;
+    int sp = 0;
+
+    for (int k = 0; k < c->len; k++) {
+        const struct cond_op *op = &c->ops[k];
+        switch (op->code) {
+            case COND_CONST: stack[sp++] = op->val; break;
+            case COND_REG  : stack[sp++] = s->machine.regs[op->val]; break;
+            case COND_MEM  : {
+                uint32_t word = 0;
+                s->dispatch_op(s, OP_READ, stack[sp - 1] & PTR_MASK, &word);
+                stack[sp - 1] = word;
+                break;
+            }
+            case COND_NEG  : stack[sp - 1] = (int32_t)-(uint32_t)stack[sp - 1]; break;
+            case COND_NOT  : stack[sp - 1] = !stack[sp - 1]; break;
+            case COND_INV  : stack[sp - 1] = ~stack[sp - 1]; break;
+
+            #define COND_CASE(Name,Expr) \
+            case COND_##Name: b = stack[--sp]; a = stack[sp - 1]; stack[sp - 1] = (Expr); break;
+            COND_BINOPS(COND_CASE)
+            #undef COND_CASE
+
+            default:
+                fatal(0, "Invalid condition code %d", op->code);
+        }
+    }
+
+    return sp ? stack[sp - 1] : 1;
+}
+
+// decides whether the enabled breakpoint at pc stops us ; hits are counted
+// only when running forwards
+static int breakpoint_stops(struct debugger_data *dd, uint32_t pc, int forwards)
+{
+    struct breakpoint *bp = kv_int_get(&dd->breakpoints, pc);
+    if (!bp || (bp->conditional && !eval_cond(dd->s, &bp->cond)))
+        return 0;
+
+    if (forwards && bp->hits < bp->after)
+        bp->hits++;
+
+    return bp->hits >= bp->after;
+}
+
+// the bitmap holds exactly the enabled breakpoints, so the tree is searched,
+// and any condition evaluated, only when P reaches one ; a watchpoint that
+// was hit stops us too
+int tdbg_stops(struct machine_state *m, void *cud)
+{
+    struct debugger_data *dd = cud;
+    uint32_t pc = m->regs[15] & PTR_MASK;
+    return dd->hit.wp || (((dd->bp_map[pc / CHAR_BIT] >> (pc % CHAR_BIT)) & 1)
+                            && breakpoint_stops(dd, pc, 1));
+}
+
+// A watched dispatch page is handed to a watch device, which passes accesses
+// on to the device that the page belongs to, and checks those made by
+// instructions against the watchpoints. Pages that are not watched keep
+// their direct path to memory.
+struct watch_page {
+    struct debugger_data *dd;
+    struct device *wrapped;     ///< the page's own device, or NULL if shared
+};
+
+static struct watchpoint *find_watchpoint(struct debugger_data *dd, int type,
+        uint32_t addr)
+{
+    list_foreach(watchpoint,wp,dd->watchpoints)
+        if ((wp->type & type) && addr - wp->addr < wp->len)
+            return wp;
+
+    return NULL;
+}
+
+static int watch_op(struct sim_state *s, void *cookie, int op, uint32_t addr,
+        uint32_t *data)
+{
+    struct watch_page *w = cookie;
+    struct device *device = w->wrapped;
+    int counted = op & OP_DATA;
+    op &= ~OP_DATA;
+
+    if (!device && !(device = find_device(s, addr)))
+        return -1;
+
+    if (counted)
+        device->accesses++;
+
+    int rc = device->op(s, device->cookie, op, addr, data);
+    if (op == OP_WRITE)
+        written(s, device, addr, 1);
+
+    struct watch_hit *hit = &w->dd->hit;
+    if (counted && !rc && !hit->wp) {
+        int type = op == OP_WRITE ? WATCH_WRITE : WATCH_READ;
+        struct watchpoint *wp = find_watchpoint(w->dd, type, addr);
+        if (wp)
+            *hit = (struct watch_hit){ wp, op, addr, *data };
     }
 
+    return rc;
+}
+
+static int watch_fini(struct sim_state *s, void *cookie)
+{
+    (void)s;
+    free(cookie);
     return 0;
 }
 
-static int matches_breakpoint(struct machine_state *m, void *cud)
+static int page_watched(struct sim_state *s, uint32_t page)
 {
-    uint32_t pc = m->regs[15];
-    void *breakpoints = cud;
-    struct breakpoint *c = kv_int_get(&breakpoints, pc);
-    return c && c->enabled && c->addr == pc;
+    struct device *d = s->machine.page_device[page];
+    return d && d->op == watch_op;
+}
+
+// puts page behind a watch device, or takes it back out
+static void watch_page(struct debugger_data *dd, uint32_t page, int on)
+{
+    struct sim_state *s = dd->s;
+    struct device **slot = &s->machine.page_device[page];
+
+    if (on && !page_watched(s, page)) {
+        struct watch_page *w = malloc(sizeof *w);
+        *w = (struct watch_page){ .dd = dd, .wrapped = *slot };
+
+        struct device *d = malloc(sizeof *d);
+        *d = (struct device){
+            .bounds = { page << DISPATCH_PAGE_BITS,
+                        (page << DISPATCH_PAGE_BITS) | DISPATCH_PAGE_MASK },
+            .name = "watch",
+            .op = watch_op,
+            .fini = watch_fini,
+            .cookie = w,
+            .op_flags = OP_DATA,
+        };
+
+        *slot = d;
+        device_map_page(s, d, page);
+    } else if (!on && page_watched(s, page)) {
+        struct device *d = *slot;
+        struct watch_page *w = d->cookie;
+        *slot = w->wrapped;
+        device_map_page(s, *slot, page);
+        d->fini(s, d->cookie);
+        free(d);
+    }
+}
+
+// makes the pages between the given ones watched exactly when a watchpoint
+// covers them
+static void update_watched_pages(struct debugger_data *dd, uint32_t first,
+        uint32_t last)
+{
+    for (uint32_t page = first; page <= last; page++) {
+        int on = 0;
+        list_foreach(watchpoint,wp,dd->watchpoints) {
+            uint32_t lo = wp->addr >> DISPATCH_PAGE_BITS;
+            uint32_t hi = (wp->addr + wp->len - 1) >> DISPATCH_PAGE_BITS;
+            on |= page >= lo && page <= hi;
+        }
+
+        watch_page(dd, page, on);
+    }
+}
+
+static const char *watch_name(int type)
+{
+    switch (type) {
+        case WATCH_READ:  return "read";
+        case WATCH_WRITE: return "write";
+        default:          return "access";
+    }
+}
+
+int tdbg_set_watchpoint(struct debugger_data *dd, int32_t addr, int32_t len,
+        int type)
+{
+    addr &= PTR_MASK;
+    if (len <= 0 || len > (int32_t)(PTR_MASK + 1 - addr)) {
+        fprintf(stderr, "Invalid watchpoint length %d\n", len);
+        return -1;
+    }
+
+    struct watchpoint *wp = malloc(sizeof *wp);
+    *wp = (struct watchpoint){
+        .next = dd->watchpoints,
+        .addr = addr,
+        .len  = len,
+        .type = type,
+    };
+    dd->watchpoints = wp;
+    update_watched_pages(dd, addr >> DISPATCH_PAGE_BITS,
+            (addr + len - 1) >> DISPATCH_PAGE_BITS);
+
+    note(dd, "Added %s watchpoint at %#lx", watch_name(type), (long unsigned)addr);
+    if (len > 1)
+        note(dd, " for %ld words", (long)len);
+    note(dd, "\n");
+
+    return 0;
+}
+
+int tdbg_delete_watchpoint(struct debugger_data *dd, int32_t addr, int type)
+{
+    addr &= PTR_MASK;
+    struct watchpoint **prev = &dd->watchpoints;
+    while (*prev && ((*prev)->addr != (uint32_t)addr || (type && (*prev)->type != type)))
+        prev = &(*prev)->next;
+
+    struct watchpoint *wp = *prev;
+    if (!wp) {
+        note(dd, "No watchpoint at %#lx\n", (long unsigned)addr);
+        return 1;
+    }
+
+    *prev = wp->next;
+    if (dd->hit.wp == wp)
+        dd->hit.wp = NULL;
+    update_watched_pages(dd, wp->addr >> DISPATCH_PAGE_BITS,
+            (wp->addr + wp->len - 1) >> DISPATCH_PAGE_BITS);
+    note(dd, "Removed watchpoint at %#lx\n", (long unsigned)addr);
+    free(wp);
+
+    return 0;
+}
+
+// reads plain memory for the undo log, looking through any watch device
+static int peek_memory(struct sim_state *s, uint32_t addr, uint32_t *old)
+{
+    uint32_t page = addr >> DISPATCH_PAGE_BITS;
+    const uint32_t *mem = s->machine.page_read[page];
+    struct device *d = s->machine.page_device[page];
+
+    if (!mem && d && d->op == watch_op) {
+        d = ((struct watch_page *)d->cookie)->wrapped;
+        if (d && d->page)
+            mem = d->page(s, d->cookie, addr);
+        if (!mem && d && d->page_shared)
+            mem = d->page_shared(s, d->cookie, addr);
+    }
+
+    if (!mem)
+        return 1;
+
+    *old = mem[addr & DISPATCH_PAGE_MASK];
+    return 0;
+}
+
+static void undo_failed(struct sim_state *s, int rc)
+{
+    if (rc > 0)
+        printf("no earlier instruction is recorded\n");
+    else if (rc < 0)
+        printf("the instruction at %#x wrote to a device\n",
+                undo_peek_entry(s->undo, 0)->pc);
+}
+
+// undoes instructions until one that stops us, at a breakpoint or at a
+// write that a watchpoint covers, is undone
+int tdbg_reverse_continue(struct debugger_data *dd)
+{
+    struct sim_state *s = dd->s;
+    uint32_t pc;
+
+    do {
+        const struct undo_entry *e = undo_peek_entry(s->undo, 0);
+        struct watchpoint *wp = NULL;
+        uint32_t addr = 0, data = 0;
+        if (e && e->type == UNDO_MEM && (wp = find_watchpoint(dd, WATCH_WRITE, e->where))) {
+            addr = e->where;
+            peek_memory(s, addr, &data);
+        }
+
+        int rc = undo_step(s);
+        if (rc)
+            return rc;
+
+        if (wp) {
+            dd->hit = (struct watch_hit){ wp, OP_WRITE, addr, data };
+            break;
+        }
+
+        pc = s->machine.regs[15];
+    } while (!((dd->bp_map[pc / CHAR_BIT] >> (pc % CHAR_BIT)) & 1)
+                || !breakpoint_stops(dd, pc, 0));
+
+    return 0;
+}
+
+static int last_write(struct debugger_data *dd, int32_t addr)
+{
+    struct undo_log *u = dd->s->undo;
+    addr &= PTR_MASK;
+
+    const struct undo_entry *e;
+    for (size_t n = 0; (e = undo_peek_entry(u, n)); n++) {
+        if ((e->type == UNDO_MEM || e->type == UNDO_DEVICE) && e->where == (uint32_t)addr) {
+            printf("%#x was last written at cycle %llu by the instruction at %#x",
+                    addr, (unsigned long long)e->cycles, e->pc);
+            if (e->type == UNDO_MEM)
+                printf(", replacing %#x", e->old);
+            putchar('\n');
+            return 0;
+        }
+    }
+
+    printf("%#x was not written in the last %zu instructions\n", addr, u->count);
+    return 0;
+}
+
+// reports, and forgets, the watchpoint that stopped the program, if any
+static void show_watch_hit(struct debugger_data *dd)
+{
+    struct watch_hit *hit = &dd->hit;
+    if (!hit->wp)
+        return;
+
+    printf("Watchpoint at %#lx : %s of %#x @ %#x\n",
+            (long unsigned)hit->wp->addr, hit->op == OP_WRITE ? "write" : "read",
+            hit->data, hit->addr);
+    hit->wp = NULL;
 }
 
 static int print_expr(struct sim_state *s, struct debug_expr *expr, int fmt)
@@ -409,11 +1199,37 @@ static int print_expr(struct sim_state *s, struct debug_expr *expr, int fmt)
     return -1;
 }
 
+static void print_counters(FILE *out, struct sim_state *s)
+{
+    fprintf(out, "%-30s %20llu\n", "instructions retired",
+            (unsigned long long)s->machine.cycles);
+
+#define PRINT_COUNTER(Name,Desc) \
+    fprintf(out, "%-30s %20llu\n", Desc, \
+            (unsigned long long)s->machine.counters.Name);
+    COUNTERS(PRINT_COUNTER)
+#undef PRINT_COUNTER
+
+    for (size_t i = 0; i < s->machine.devices_count; i++) {
+        struct device *d = s->machine.devices[i];
+        if (!d)
+            continue;
+
+        char name[DEVICE_NAME_LEN + 16];
+        snprintf(name, sizeof name, "accesses to %s", d->name);
+        fprintf(out, "%-30s %20llu  (%#x-%#x)\n", name,
+                (unsigned long long)d->accesses, d->bounds[0], d->bounds[1]);
+    }
+}
+
 static int get_info(struct sim_state *s, struct debug_cmd *c)
 {
     if (!strncmp(c->arg.str, "registers", sizeof c->arg.str)) {
         print_registers(stdout, s->machine.regs);
         return 0;
+    } else if (!strncmp(c->arg.str, "counters", sizeof c->arg.str)) {
+        print_counters(stdout, s);
+        return 0;
     } else {
         fprintf(stderr, "Invalid argument `%s' to info", c->arg.str);
         return -1;
@@ -460,10 +1276,16 @@ static int debugger_step(struct debugger_data *dd)
             get_info(dd->s, c);
             break;
         case CMD_DELETE_BREAKPOINT:
-            delete_breakpoint(&dd->breakpoints, c->arg.expr.val);
+            tdbg_delete_breakpoint(dd, c->arg.expr.val);
             break;
         case CMD_SET_BREAKPOINT:
-            set_breakpoint(&dd->breakpoints, c->arg.expr.val);
+            tdbg_set_breakpoint(dd, c->arg.expr.val, c->arg.cond, c->arg.after);
+            break;
+        case CMD_DELETE_WATCHPOINT:
+            tdbg_delete_watchpoint(dd, c->arg.expr.val, 0);
+            break;
+        case CMD_SET_WATCHPOINT:
+            tdbg_set_watchpoint(dd, c->arg.expr.val, c->arg.len, c->arg.watch);
             break;
         case CMD_DISPLAY:
             add_display(dd, c->arg.expr, c->arg.fmt);
@@ -475,8 +1297,9 @@ static int debugger_step(struct debugger_data *dd)
             int32_t *ip = &dd->s->machine.regs[15];
             printf("Continuing @ %#x ... ", *ip);
             tf_run_until(dd->s, *ip, TF_IGNORE_FIRST_PREDICATE,
-                    matches_breakpoint, dd->breakpoints);
+                    tdbg_stops, dd);
             printf("stopped @ %#x\n", *ip);
+            show_watch_hit(dd);
             show_displays(dd);
             break;
         }
@@ -485,14 +1308,65 @@ static int debugger_step(struct debugger_data *dd)
             int32_t *ip = &dd->s->machine.regs[15];
             dd->s->dispatch_op(dd->s, OP_READ, *ip, &i.u.word);
             printf("Stepping @ %#x ... ", *ip);
-            if (run_instruction(dd->s, &i)) {
+            if (run_instruction(dd->s, &i) ||
+                    (dd->s->run_ops && run_events(dd->s, dd->s->run_ops))) {
                 printf("failed (P = %#x)\n", *ip);
                 return 1;
             }
             printf("stopped @ %#x\n", *ip);
+            show_watch_hit(dd);
             show_displays(dd);
             break;
         }
+        case CMD_REVERSE_STEP: {
+            int32_t *ip = &dd->s->machine.regs[15];
+            printf("Stepping back @ %#x ... ", *ip);
+            int rc = undo_step(dd->s);
+            if (rc) {
+                undo_failed(dd->s, rc);
+                break;
+            }
+            printf("stopped @ %#x\n", *ip);
+            show_displays(dd);
+            break;
+        }
+        case CMD_REVERSE_CONTINUE: {
+            int32_t *ip = &dd->s->machine.regs[15];
+            printf("Reversing @ %#x ... ", *ip);
+            int rc = tdbg_reverse_continue(dd);
+            printf("stopped @ %#x", *ip);
+            if (rc) {
+                fputs(" : ", stdout);
+                undo_failed(dd->s, rc);
+            } else {
+                putchar('\n');
+            }
+            show_watch_hit(dd);
+            show_displays(dd);
+            break;
+        }
+        case CMD_LAST_WRITE:
+            last_write(dd, c->arg.expr.val);
+            break;
+        case CMD_CHECKPOINT:
+            if (dd->checkpoint)
+                fclose(dd->checkpoint);
+            if (!(dd->checkpoint = tmpfile()))
+                fatal(PRINT_ERRNO, "Failed to create checkpoint");
+            snapshot_save(dd->s, dd->checkpoint);
+            printf("Checkpoint @ %#x\n", dd->s->machine.regs[15]);
+            break;
+        case CMD_REWIND:
+            if (!dd->checkpoint) {
+                fputs("No checkpoint to rewind to\n", stderr);
+                break;
+            }
+            rewind(dd->checkpoint);
+            snapshot_load(dd->s, dd->checkpoint);
+            undo_clear(dd->s->undo);
+            printf("Rewound @ %#x\n", dd->s->machine.regs[15]);
+            show_displays(dd);
+            break;
         case CMD_QUIT:
             done = 1;
             break;
@@ -503,10 +1377,51 @@ static int debugger_step(struct debugger_data *dd)
     return done;
 }
 
-static int run_debugger(struct sim_state *s, FILE *stream)
+int tdbg_init(struct debugger_data *dd, struct sim_state *s)
 {
-    struct debugger_data _dd = { .s = s }, *dd = &_dd;
+    *dd = (struct debugger_data){ .s = s };
     kv_int_init(&dd->breakpoints);
+    dd->bp_map = calloc((PTR_MASK + 1) / CHAR_BIT, 1);
+
+    const char *val;
+    size_t history = UNDO_ENTRIES;
+    if (param_get(s, "debug.history", &val))
+        history = strtoul(val, NULL, 0);
+    if (history == 0)
+        fatal(0, "Parameter debug.history must be positive");
+    s->undo = undo_open(history, peek_memory);
+
+    return 0;
+}
+
+int tdbg_fini(struct debugger_data *dd)
+{
+    struct sim_state *s = dd->s;
+
+    list_foreach(debug_display,disp,dd->displays)
+        free(disp);
+
+    if (dd->checkpoint)
+        fclose(dd->checkpoint);
+
+    while (dd->watchpoints) {
+        struct watchpoint *wp = dd->watchpoints;
+        dd->watchpoints = wp->next;
+        free(wp);
+    }
+    update_watched_pages(dd, 0, DISPATCH_PAGES - 1);
+
+    free(dd->bp_map);
+    undo_close(s->undo);
+    s->undo = NULL;
+
+    return 0;
+}
+
+static int run_debugger(struct sim_state *s, FILE *stream)
+{
+    struct debugger_data _dd, *dd = &_dd;
+    tdbg_init(dd, s);
 
     tdbg_lex_init(&dd->scanner);
     tdbg_set_extra(dd, dd->scanner);
@@ -516,16 +1431,17 @@ static int run_debugger(struct sim_state *s, FILE *stream)
     while (!done && !feof(stream))
         done = debugger_step(dd);
 
-    list_foreach(debug_display,disp,dd->displays)
-        free(disp);
-
     tdbg_lex_destroy(dd->scanner);
+    tdbg_fini(dd);
 
     return 0;
 }
 
 static int pre_insn(struct sim_state *s, struct instruction *i)
 {
+    if (s->trace)
+        trace_begin(s->trace, s->machine.regs[15], i->u.word);
+
     if (s->conf.verbose > 0)
         printf("IP = 0x%06x\t", s->machine.regs[15]);
 
@@ -548,8 +1464,8 @@ static int pre_insn(struct sim_state *s, struct instruction *i)
 
 static int post_insn(struct sim_state *s, struct instruction *i)
 {
-    (void)i;
-    return devices_dispatch_cycle(s);
+    trace_end(s->trace, s->machine.regs[i->u._0xxx.z]);
+    return 0;
 }
 
 int set_format(struct sim_state *s, const char *optarg, const struct format **f)
@@ -649,6 +1565,7 @@ int main(int argc, char *argv[])
             .params       = calloc(DEFAULT_PARAMS_COUNT, sizeof *_s.conf.params),
         },
         .dispatch_op = dispatch_op,
+        .dispatch_block = dispatch_block,
     }, *s = &_s;
 
     if ((rc = setjmp(errbuf))) {
@@ -660,6 +1577,10 @@ int main(int argc, char *argv[])
     int load_address = RAM_BASE, start_address = RAM_BASE;
 
     const struct format *f = &formats[0];
+    const char *trace_name = NULL;
+    const char *restore_name = NULL;
+    const char *gdb_where = NULL;
+    FILE *trace_out = NULL;
 
     int ch;
     while ((ch = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1) {
@@ -667,11 +1588,16 @@ int main(int argc, char *argv[])
             case 'a': load_address = strtol(optarg, NULL, 0); break;
             case 'd': s->conf.debugging = 1; break;
             case 'f': if (set_format(s, optarg, &f)) exit(usage(argv[0])); break;
+            case 'g': gdb_where = optarg; break;
             case 'n': s->conf.run_defaults = 0; break;
             case 'p': param_add(s, optarg); break;
             case 'r': add_recipe(s, optarg); break;
+            case 'R': restore_name = optarg; break;
             case 's': start_address = strtol(optarg, NULL, 0); break;
+            case 'S': s->conf.stats = 1; break;
+            case 'T': trace_name = optarg; break;
             case 'v': s->conf.verbose++; break;
+            case 'w': save.name = optarg; break;
 
             case 'V': puts(version()); return EXIT_SUCCESS;
             case 'h': usage(argv[0]) ; return EXIT_SUCCESS;
@@ -679,15 +1605,15 @@ int main(int argc, char *argv[])
         }
     }
 
+    FILE *in = NULL;
+
+    const char *val;
     if (optind >= argc) {
-        fatal(DISPLAY_USAGE, "No input files specified on the command line");
+        if (!restore_name && !param_get(s, "ram.image", &val))
+            fatal(DISPLAY_USAGE, "No input files specified on the command line");
     } else if (argc - optind > 1) {
         fatal(DISPLAY_USAGE, "More than one input file specified on the command line");
-    }
-
-    FILE *in = stdin;
-
-    if (!strcmp(argv[optind], "-")) {
+    } else if (!strcmp(argv[optind], "-")) {
         in = stdin;
     } else {
         in = fopen(argv[optind], "rb");
@@ -702,23 +1628,66 @@ int main(int argc, char *argv[])
     run_recipes(s);
     devices_finalise(s);
 
-    load_sim(s->dispatch_op, s, f, in, load_address);
+    if (in)
+        load_sim(s, f, in, load_address);
     s->machine.regs[15] = start_address & PTR_MASK;
 
+    if (restore_name)
+        restore_state(s, restore_name);
+
+    if (save.name && param_get(s, "save.at", &val))
+        save.at = strtoull(val, NULL, 0);
+
+    if (trace_name) {
+        trace_out = strcmp(trace_name, "-") ? fopen(trace_name, "wb") : stdout;
+        if (!trace_out || !(s->trace = trace_open(trace_out, TRACE_BUFFER)))
+            fatal(PRINT_ERRNO, "Failed to open trace file `%s'", trace_name);
+        s->dispatch_op = trace_dispatch_op;
+    }
+
     struct run_ops ops = {
-        .pre_insn = pre_insn,
-        .post_insn = post_insn,
+        // pre_insn() only traces, so leave it out of the loop when quiet
+        .pre_insn = s->conf.verbose || s->trace ? pre_insn : NULL,
+        .post_insn = s->trace ? post_insn : NULL,
+        .event = dispatch_event,
     };
+    // the debugger runs instructions one at a time, with events between them
+    s->run_ops = &ops;
 
+    // a GDB client that detaches leaves the program to run on
+    int resume = !s->conf.debugging;
     if (s->conf.debugging)
         run_debugger(s, stdin);
-    else
+    else if (gdb_where)
+        resume = gdb_serve(s, gdb_where);
+
+    if (resume && s->conf.blocks)
+        run_blocks(s, &ops);
+    else if (resume)
         run_sim(s, &ops);
 
+    if (save.name)
+        save_state(s, save.name);
+
+    if (s->conf.stats)
+        print_counters(stderr, s);
+
+    if (s->trace) {
+        trace_close(s->trace);
+        if (trace_out != stdout)
+            fclose(trace_out);
+    }
+
+    if (s->prof) {
+        write_profile(s);
+        prof_fini(s->prof);
+    }
+
     if (in)
         fclose(in);
 
     devices_teardown(s);
+    free(s->symbols);
 
     while (s->conf.params_count--)
         param_free(&s->conf.params[s->conf.params_count]);
@@ -0,0 +1,79 @@
+#include "undo.h"
+#include "sim.h"
+#include "common.h"
+
+#include <stdlib.h>
+
+struct undo_log *undo_open(size_t size, undo_peek *peek)
+{
+    struct undo_log *u = calloc(1, sizeof *u);
+    u->peek = peek;
+    u->size = size;
+    if (!(u->buf = malloc(size * sizeof *u->buf)))
+        fatal(PRINT_ERRNO, "Failed to allocate undo log of %zu entries", size);
+
+    return u;
+}
+
+void undo_close(struct undo_log *u)
+{
+    free(u->buf);
+    free(u);
+}
+
+void undo_clear(struct undo_log *u)
+{
+    u->head = u->count = 0;
+}
+
+void undo_note(struct sim_state *s, int mem, uint32_t addr, int reg)
+{
+    struct undo_log *u = s->undo;
+    struct undo_entry *e = &u->buf[u->head];
+
+    *e = (struct undo_entry){
+        .cycles = s->machine.cycles,
+        .pc     = (s->machine.regs[15] - 1) & PTR_MASK,
+        .where  = mem ? addr : (uint32_t)reg,
+        .type   = mem ? UNDO_MEM : reg ? UNDO_REG : UNDO_NONE,
+    };
+
+    if (mem && u->peek(s, addr, &e->old))
+        e->type = UNDO_DEVICE;
+    else if (!mem)
+        e->old = s->machine.regs[reg];
+
+    u->head = (u->head + 1) % u->size;
+    if (u->count < u->size)
+        u->count++;
+}
+
+int undo_step(struct sim_state *s)
+{
+    struct undo_log *u = s->undo;
+    const struct undo_entry *e = undo_peek_entry(u, 0);
+    if (!e)
+        return 1;
+
+    uint32_t old = e->old;
+    switch (e->type) {
+        case UNDO_DEVICE:
+            return -1;
+        case UNDO_MEM:
+            s->dispatch_op(s, OP_WRITE, e->where, &old);
+            sim_note_write(s, e->where, 1);
+            break;
+        case UNDO_REG:
+            s->machine.regs[e->where] = old;
+            break;
+    }
+
+    s->machine.regs[15] = e->pc;
+    s->machine.cycles = e->cycles;
+
+    u->head = (u->head + u->size - 1) % u->size;
+    u->count--;
+
+    return 0;
+}
+
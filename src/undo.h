@@ -0,0 +1,70 @@
+/*
+ * A record of what recent instructions overwrote, so that they can be undone
+ * one at a time, newest first. Each instruction run while a log is attached
+ * (see do_common()) adds one entry ; once the log is full, each new entry
+ * replaces the oldest.
+ */
+
+#ifndef UNDO_H_
+#define UNDO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct sim_state;
+
+/// entries kept by default
+#define UNDO_ENTRIES    (1u << 20)
+
+enum undo_type {
+    UNDO_NONE,      ///< nothing was overwritten (a write to A)
+    UNDO_REG,       ///< a register
+    UNDO_MEM,       ///< a word of memory
+    UNDO_DEVICE,    ///< a device, whose write cannot be undone
+};
+
+struct undo_entry {
+    uint64_t cycles;    ///< machine.cycles before the instruction
+    uint32_t pc;        ///< address of the instruction
+    uint32_t where;     ///< register number or address overwritten
+    uint32_t old;       ///< the value overwritten
+    uint32_t type;      ///< an undo_type
+};
+
+/// reads into *old the word at addr without side effects, returning zero, or
+/// returns nonzero if addr is not plain memory
+typedef int undo_peek(struct sim_state *s, uint32_t addr, uint32_t *old);
+
+struct undo_log {
+    undo_peek *peek;
+    size_t size;        ///< entries that fit in buf
+    size_t head;        ///< where the next entry goes
+    size_t count;       ///< entries held, ending just before head
+    struct undo_entry *buf;
+};
+
+struct undo_log *undo_open(size_t size, undo_peek *peek);
+void undo_close(struct undo_log *u);
+/// forgets every entry, as when the machine is changed from outside
+void undo_clear(struct undo_log *u);
+
+/// records what the instruction at P - 1 is about to overwrite : the word at
+/// addr if mem is set, or else register reg
+void undo_note(struct sim_state *s, int mem, uint32_t addr, int reg);
+
+/// returns the entry n places back from the newest (0), or NULL
+static inline const struct undo_entry *undo_peek_entry(const struct undo_log *u,
+        size_t n)
+{
+    if (n >= u->count)
+        return NULL;
+
+    return &u->buf[(u->head + u->size - 1 - n) % u->size];
+}
+
+/// undoes the newest instruction ; returns zero on success, 1 if the log is
+/// empty, and -1 if the instruction wrote to a device (and so is not undone)
+int undo_step(struct sim_state *s);
+
+#endif
+
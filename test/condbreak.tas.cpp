@@ -0,0 +1,13 @@
+// Counts to ten for the debugger to stop part way, at breakpoints that wait
+// for a number of hits or for a condition on the count in b.
+#include "common.th"
+
+_start:
+    b <- 0
+
+top:
+    b <- b + 1
+    c <- b < 10
+    jnzrel(c,top)
+    illegal
+
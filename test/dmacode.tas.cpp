@@ -0,0 +1,38 @@
+// Runs a routine, has the DMA controller copy another over it, and runs it
+// again ; the second call must not run what was there before.
+#include "common.th"
+#include "dma.th"
+#include "serial.th"
+
+_start:
+    prologue
+    call(slot)
+
+    b <- rel(other)
+    b -> DMA_SRC
+    b <- rel(slot)
+    b -> DMA_DST
+    b <- 4                      // length of slot
+    b -> DMA_LEN
+    b <- DMA_GO
+    b -> DMA_CTRL
+
+wait:
+    b <- DMA_CTRL
+    b <- b & DMA_BUSY
+    b <- b <> 0
+    jnzrel(b,wait)
+
+    call(slot)
+    illegal
+
+slot:
+    b <- 'A'
+    emit(b)
+    ret
+
+other:
+    b <- 'B'
+    emit(b)
+    ret
+
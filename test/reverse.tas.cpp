@@ -0,0 +1,17 @@
+// Sets b three times and writes it to a cell twice, for the debugger and the
+// GDB server to step back through ; the session files name the addresses of
+// the illegal instruction (0x1006) and of the cell (0x1007).
+#include "common.th"
+
+_start:
+    b <- 1
+    c <- rel(cell)
+    b -> [c]
+    b <- 2
+    b -> [c]
+    b <- 3
+    illegal
+
+cell:
+    .word 0
+
@@ -0,0 +1,30 @@
+// Rewrites an instruction in a routine before each call to it, so every
+// engine must see stores into code it has already run.
+#include "common.th"
+#include "serial.th"
+
+_start:
+    prologue
+    e <- 0                      // index into table
+
+top:
+    f <- rel(table)
+    f <- [f + e]
+    g <- rel(put)
+    f -> [g]                    // replace the first instruction of put
+    call(put)
+    e <- e + 1
+    f <- e < 3
+    jnzrel(f,top)
+    illegal
+
+put:
+    b <- 'x'
+    emit(b)
+    ret
+
+table:
+    b <- 'a'
+    b <- 'b'
+    b <- 'c'
+
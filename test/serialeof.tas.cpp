@@ -0,0 +1,20 @@
+// Reads from the serial port when there is no input at all ; the read must
+// give all ones, as a program waiting for end of input expects.
+#include "common.th"
+#include "serial.th"
+
+_start:
+    b <- SERIAL
+    b <- b + 1
+    c <- b == 0
+    jnzrel(c,yes)
+
+    b <- 'n'
+    emit(b)
+    illegal
+
+yes:
+    b <- 'y'
+    emit(b)
+    illegal
+
@@ -0,0 +1,12 @@
+// Writes to the serial port without a newline and then stops on a reserved
+// opcode ; what was written must still come out.
+#include "common.th"
+#include "serial.th"
+
+_start:
+    b <- 'o'
+    emit(b)
+    b <- 'k'
+    emit(b)
+    .word 0x00004000            // reserved opcode, a fatal error
+
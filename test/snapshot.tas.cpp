@@ -0,0 +1,41 @@
+// Fills a table with running sums and then checks it from the end, printing y
+// if every entry is right ; the check saves a snapshot part way through the
+// filling, and the run finished from it must print the same.
+#include "common.th"
+#include "serial.th"
+
+_start:
+    b <- 0                      // index into table
+    c <- 0                      // running sum
+    d <- rel(table)
+
+fill:
+    c <- c + b
+    e <- d + b
+    c -> [e]
+    b <- b + 1
+    e <- b < 100
+    jnzrel(e,fill)
+
+check:
+    b <- b - 1
+    e <- d + b
+    e <- [e]
+    e <- e <> c
+    jnzrel(e,bad)
+    c <- c - b
+    e <- b > 0
+    jnzrel(e,check)
+
+    b <- 'y'
+    emit(b)
+    illegal
+
+bad:
+    b <- 'n'
+    emit(b)
+    illegal
+
+table:
+    .word 0
+
@@ -0,0 +1,27 @@
+// Sleeps until a timer interrupt, whose handler prints I, so the program ends
+// only if interrupts are taken between instructions however it is run, even
+// one instruction at a time in a debugger.
+#include "common.th"
+#include "intc.th"
+#include "serial.th"
+#include "timer.th"
+
+_start:
+    b <- rel(handler)
+    b -> INTC_VECTOR
+    b <- 1                      // the timer raises line 0
+    b -> INTC_ENABLED
+    b <- INTC_IE
+    b -> INTC_CTRL
+    b <- 100
+    b -> TIMER_PERIOD
+    b <- TIMER_ON
+    b -> TIMER_CTRL
+    b -> INTC_WAIT
+    illegal
+
+handler:
+    b <- 'I'
+    emit(b)
+    illegal
+
@@ -0,0 +1,22 @@
+// Polls the timer until it is about to expire. The loop leaves the registers
+// as they were, but must not be taken for an idle one and skipped to the
+// expiry, after which (the timer repeating) it would never end.
+#include "common.th"
+#include "serial.th"
+#include "timer.th"
+
+_start:
+    b <- 1000
+    b -> TIMER_PERIOD
+    b <- (TIMER_ON + TIMER_REPEAT)
+    b -> TIMER_CTRL
+
+wait:
+    b <- TIMER_LEFT
+    b <- b > 10
+    jnzrel(b,wait)
+
+    b <- 'T'
+    emit(b)
+    illegal
+
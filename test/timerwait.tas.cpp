@@ -0,0 +1,23 @@
+// Waits for a one-shot timer by polling its status, which changes only when
+// the timer acts, so the wait ends only if devices act between instructions
+// however the program is run, even one instruction at a time in a debugger.
+#include "common.th"
+#include "serial.th"
+#include "timer.th"
+
+_start:
+    b <- 100
+    b -> TIMER_PERIOD
+    b <- TIMER_ON
+    b -> TIMER_CTRL
+
+wait:
+    b <- TIMER_STATUS
+    b <- b & TIMER_EXPIRED
+    b <- b == 0
+    jnzrel(b,wait)
+
+    b <- 'T'
+    emit(b)
+    illegal
+